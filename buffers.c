@@ -0,0 +1,143 @@
+/*
+ * Buffer pool in one mapping, made at startup, so memory use doesn't
+ * grow with load.  It's backed by huge pages if the system has them
+ * reserved, otherwise transparent huge pages are asked for.
+ *
+ * Free buffers are a stack linked through their indexes.  Giving one
+ * back pushes it with compare and swap from any thread.  The one
+ * thread that takes buffers swaps out the whole stack when it runs
+ * out, so no pop races a push of the same buffer.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#include "pty-stdio.h"
+#include "buffers.h"
+
+#define NONE UINT32_MAX
+#define HUGE_PAGE (2 * 1024 * 1024)
+
+static char *base;
+static size_t each;
+static unsigned count;
+static uint32_t *next;
+static uint32_t *refs;
+static uint32_t top = NONE;      // Given back.
+static uint32_t taken = NONE;    // Owned by the taker.
+static uint32_t waiting;
+
+unsigned buffers_init (size_t size, size_t buffer_size)
+{
+  size_t length;
+  unsigned i;
+
+  // Buffers on cache line boundaries.
+  each = (buffer_size + 63) & ~(size_t)63;
+  count = size / each;
+  if (count < 2)
+    count = 2;
+  length = (count * each + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1);
+
+  base = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  base = mmap(NULL, length, PROT_READ | PROT_WRITE,
+	      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+  if (base == MAP_FAILED)
+    {
+      base = mmap(NULL, length, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (base == MAP_FAILED)
+	fatal("Error %d on mmap()", errno);
+#ifdef MADV_HUGEPAGE
+      madvise(base, length, MADV_HUGEPAGE);
+#endif
+    }
+
+  next = malloc(count * sizeof *next);
+  refs = calloc(count, sizeof *refs);
+  if (next == NULL || refs == NULL)
+    fatal("Out of memory");
+  for (i = 0; i < count; i++)
+    next[i] = i + 1 < count ? i + 1 : NONE;
+  taken = 0;
+
+  return count;
+}
+
+char *buffer_data (unsigned b)
+{
+  return base + b * each;
+}
+
+int buffer_get (void)
+{
+#ifndef __linux__
+  struct timespec pause = { 0, 100000 };
+#endif
+  uint32_t b;
+
+  while (taken == NONE)
+    {
+      taken = __atomic_exchange_n(&top, NONE, __ATOMIC_ACQUIRE);
+      if (taken != NONE)
+	break;
+
+      // Ordered before the load of top, as buffer_put orders its push
+      // before the load of waiting.
+      __atomic_store_n(&waiting, 1, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&top, __ATOMIC_SEQ_CST) == NONE)
+	{
+#ifdef __linux__
+	  if (syscall(SYS_futex, &top, FUTEX_WAIT_PRIVATE, NONE,
+		      NULL, NULL, 0) == -1 && errno == EINTR)
+	    {
+	      __atomic_store_n(&waiting, 0, __ATOMIC_SEQ_CST);
+	      return -1;
+	    }
+#else
+	  nanosleep(&pause, NULL);
+#endif
+	}
+      __atomic_store_n(&waiting, 0, __ATOMIC_SEQ_CST);
+    }
+
+  b = taken;
+  taken = next[b];
+  return b;
+}
+
+void buffer_hold (unsigned b, unsigned n)
+{
+  __atomic_store_n(&refs[b], n, __ATOMIC_RELAXED);
+}
+
+void buffer_put (unsigned b)
+{
+  uint32_t old;
+
+  if (__atomic_sub_fetch(&refs[b], 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+
+  old = __atomic_load_n(&top, __ATOMIC_RELAXED);
+  do
+    next[b] = old;
+  while (!__atomic_compare_exchange_n(&top, &old, b, 1, __ATOMIC_SEQ_CST,
+				      __ATOMIC_RELAXED));
+
+  if (__atomic_load_n(&waiting, __ATOMIC_SEQ_CST))
+    {
+#ifdef __linux__
+      syscall(SYS_futex, &top, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+    }
+}
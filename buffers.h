@@ -0,0 +1,27 @@
+/*
+ * A fixed pool of reference counted buffers, for the stages of the
+ * threaded relay to hand data to each other without copying it.  The
+ * event loop engines have buffers of their own.
+ */
+
+#ifndef BUFFERS_H
+#define BUFFERS_H
+
+#include <stddef.h>
+
+// Map size bytes for buffers of buffer_size bytes each.  Returns how
+// many there are.
+extern unsigned buffers_init (size_t size, size_t buffer_size);
+
+extern char *buffer_data (unsigned b);
+
+// A free buffer, waiting for one if need be, or -1 if a signal came
+// first.  Only one thread may take buffers, any may give them back.
+extern int buffer_get (void);
+
+// Set how many stages will give the buffer back, and give it back.
+// It's free again when the last one has.
+extern void buffer_hold (unsigned b, unsigned refs);
+extern void buffer_put (unsigned b);
+
+#endif
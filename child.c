@@ -0,0 +1,112 @@
+/*
+ * Child exit, seen through a pidfd on Linux, or a SIGCHLD handler that
+ * writes to a pipe elsewhere.  Either goes in the event loop.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include "pty-stdio.h"
+#include "child.h"
+#include "tail.h"
+
+static pid_t child = -1;
+static int pidfd = -1;
+static int self[2] = { -1, -1 };
+static int status = -1;   // Once known.
+
+static void handler (int sig)
+{
+  int saved = errno;
+
+  write(self[1], "", 1);
+  errno = saved;
+}
+
+void child_watch (pid_t pid)
+{
+  struct sigaction sa;
+
+  child = pid;
+
+#ifdef SYS_pidfd_open
+  pidfd = syscall(SYS_pidfd_open, pid, 0);
+  if (pidfd != -1)
+    {
+      fcntl(pidfd, F_SETFD, FD_CLOEXEC);
+      return;
+    }
+#endif
+
+  if (pipe(self) == -1)
+    fatal("Error %d on pipe()", errno);
+  fcntl(self[0], F_SETFD, FD_CLOEXEC);
+  fcntl(self[1], F_SETFD, FD_CLOEXEC);
+  fcntl(self[0], F_SETFL, O_NONBLOCK);
+  fcntl(self[1], F_SETFL, O_NONBLOCK);
+
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = handler;
+  sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGCHLD, &sa, NULL);
+
+  // It may be gone already, look once to be sure.
+  write(self[1], "", 1);
+}
+
+int child_fd (void)
+{
+  return pidfd != -1 ? pidfd : self[0];
+}
+
+static void decode (int wstatus)
+{
+  if (WIFEXITED(wstatus))
+    status = WEXITSTATUS(wstatus);
+  else if (WIFSIGNALED(wstatus))
+    status = 128 + WTERMSIG(wstatus);
+}
+
+int child_reap (void)
+{
+  char buffer[64];
+  int wstatus;
+
+  if (child == -1 || status != -1)
+    return status != -1;
+
+  if (self[0] != -1)
+    while (read(self[0], buffer, sizeof buffer) > 0)
+      ;
+
+  if (waitpid(child, &wstatus, WNOHANG) == child)
+    decode(wstatus);
+  return status != -1;
+}
+
+int child_status (void)
+{
+  int wstatus;
+
+  if (child == -1)
+    return 0;
+
+  while (status == -1)
+    {
+      if (waitpid(child, &wstatus, 0) == child)
+	decode(wstatus);
+      else if (errno != EINTR)
+	return 0;
+    }
+
+  // The program failed, keep the last it said.
+  if (status != 0)
+    tail_dump();
+  return status;
+}
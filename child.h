@@ -0,0 +1,26 @@
+/*
+ * Watch for the program to exit, so pty-stdio can exit with its status.
+ */
+
+#ifndef CHILD_H
+#define CHILD_H
+
+#include <sys/types.h>
+
+// Microseconds to wait after the program exits for its last output to
+// reach the master side, if something else keeps the pty open.
+#define CHILD_LINGER_USEC 20000
+
+extern void child_watch (pid_t pid);
+
+// Readable once the program has exited, or -1 if there is none.
+extern int child_fd (void);
+
+// Reap the program if it has exited.  Returns whether it has.
+extern int child_reap (void);
+
+// The program's exit status, or 128 plus the signal that killed it,
+// waiting for it if need be.  0 without a program.
+extern int child_status (void);
+
+#endif
@@ -0,0 +1,620 @@
+/*
+ * Compression for the relay.  lz4 is built in, writing the standard
+ * frame format with linked blocks, so matches reach back into earlier
+ * blocks and small blocks still compress well.  A block ends whenever
+ * the relay runs out of output to read, so compressed output is as
+ * interactive as the plain one.  Decompression takes any lz4 frames.
+ *
+ * zstd needs the library, and is built with -DHAVE_ZSTD and -lzstd.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "pty-stdio.h"
+#include "compress.h"
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+enum { NONE, LZ4, ZSTD };
+
+static int codec = NONE;
+
+// Bytes given to compress_put since the last flush.
+static size_t held;
+
+// Room for headers, block sizes, and the end of the stream.
+#define SLACK 256
+
+#define LZ4_MAGIC      0x184d2204
+#define LZ4_SKIPPABLE  0x184d2a50
+
+#define HISTORY        65536  // How far back matches reach.
+#define BLOCK          65536  // Largest block made here.
+#define HASH_LOG       14
+#define MIN_MATCH      4
+#define LAST_LITERALS  5      // A block ends with this many literals,
+#define MATCH_LIMIT    12     // and its last match starts before this.
+
+// Version 1, linked blocks, no checksums, 64K blocks, and the header
+// checksum for that.
+static const unsigned char lz4_header[] =
+  { 0x04, 0x22, 0x4d, 0x18, 0x40, 0x40, 0xc0 };
+
+// Compressor: input waits in the window after up to HISTORY bytes of
+// what came before it.
+static unsigned char *window;
+static size_t start, end;
+static unsigned table[1 << HASH_LOG];
+static unsigned char *block;
+static int started;
+
+static unsigned read32 (const unsigned char *p)
+{
+  unsigned v;
+
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static unsigned hash (const unsigned char *p)
+{
+  return read32(p) * 2654435761U >> (32 - HASH_LOG);
+}
+
+static void put32 (unsigned char *p, unsigned v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+// Lengths from 15 on go on in bytes of 255 and a remainder.
+static unsigned char *put_length (unsigned char *op, size_t n)
+{
+  for (n -= 15; n >= 255; n -= 255)
+    *op++ = 255;
+  *op++ = n;
+  return op;
+}
+
+// Literals, then a match unless it's the last sequence.
+static unsigned char *sequence (unsigned char *op, const unsigned char *literal,
+				size_t literals, size_t offset, size_t match)
+{
+  unsigned char *token = op++;
+
+  *token = (literals < 15 ? literals : 15) << 4;
+  if (literals >= 15)
+    op = put_length(op, literals);
+  memcpy(op, literal, literals);
+  op += literals;
+  if (match == 0)
+    return op;
+
+  *op++ = offset;
+  *op++ = offset >> 8;
+  match -= MIN_MATCH;
+  *token |= match < 15 ? match : 15;
+  if (match >= 15)
+    op = put_length(op, match);
+  return op;
+}
+
+// Compress the window from start to end into a block with its size in
+// front.  Returns the length of it all.
+static size_t lz4_block (unsigned char *out)
+{
+  const unsigned char *ip = window + start, *anchor = ip, *ref;
+  const unsigned char *iend = window + end, *limit, *last;
+  unsigned char *op = out + 4;
+  size_t n = end - start, length;
+  unsigned h, misses = 0;
+
+  // Matches end before the last literals, and start before the last
+  // match can.  A short block is all literals.
+  limit = n > MATCH_LIMIT ? iend - LAST_LITERALS : ip;
+  last = n > MATCH_LIMIT ? iend - MATCH_LIMIT : ip;
+
+  while (ip < last)
+    {
+      h = hash(ip);
+      ref = window + table[h];
+      table[h] = ip - window;
+
+      // Step faster through data that doesn't compress.
+      if (ref >= ip || ip - ref > 65535 || read32(ref) != read32(ip))
+	{
+	  ip += 1 + (misses++ >> 6);
+	  continue;
+	}
+      misses = 0;
+
+      while (ip > anchor && ref > window && ip[-1] == ref[-1])
+	ip--, ref--;
+      for (length = MIN_MATCH; ip + length < limit && ip[length] == ref[length];
+	   length++)
+	;
+      op = sequence(op, anchor, ip - anchor, ip - ref, length);
+      ip += length;
+      anchor = ip;
+    }
+  op = sequence(op, anchor, iend - anchor, 0, 0);
+
+  length = op - (out + 4);
+  if (length < n)
+    put32(out, length);
+  else
+    {
+      // Stored as it is.
+      memcpy(out + 4, window + start, n);
+      put32(out, n | 0x80000000);
+      length = n;
+    }
+
+  start = end;
+  return length + 4;
+}
+
+static void lz4_flush (struct ring *r)
+{
+  if (!started)
+    {
+      ring_put(r, (const char *)lz4_header, sizeof lz4_header);
+      started = 1;
+    }
+  if (end > start)
+    ring_put(r, (const char *)block, lz4_block(block));
+}
+
+static void lz4_put (struct ring *r, const char *data, size_t n)
+{
+  size_t length, shift, i;
+
+  while (n > 0)
+    {
+      if (end - start == BLOCK)
+	lz4_flush(r);
+
+      // Keep HISTORY bytes before the pending input.
+      if (end == HISTORY + BLOCK)
+	{
+	  shift = start - HISTORY;
+	  memmove(window, window + shift, end - shift);
+	  start -= shift;
+	  end -= shift;
+	  for (i = 0; i < sizeof table / sizeof table[0]; i++)
+	    table[i] = table[i] > shift ? table[i] - shift : 0;
+	}
+
+      length = HISTORY + BLOCK - end;
+      if (length > BLOCK - (end - start))
+	length = BLOCK - (end - start);
+      if (length > n)
+	length = n;
+      memcpy(window + end, data, length);
+      end += length;
+      data += length;
+      n -= length;
+    }
+}
+
+// Decompressor: what's been read of the current header field or block,
+// and the decompressed output after up to HISTORY bytes of what came
+// before.
+enum { MAGIC, DESCRIPTOR, HEADER, SIZE, DATA, BLOCK_CHECKSUM, SKIP_SIZE, SKIP };
+
+static struct
+{
+  int state;
+  unsigned char field[16];
+  unsigned char *data;      // Where the current part goes, or NULL.
+  size_t have, need;
+  int flags;
+  size_t max;               // Largest block in this frame.
+  size_t size;              // Of the current block.
+  unsigned char *block;
+  unsigned char *window;
+  size_t start, end;        // Output not yet passed on.
+  size_t room;              // Size of the window.
+} in;
+
+#define FLAG_BLOCK_CHECKSUM    0x10
+#define FLAG_CONTENT_SIZE      0x08
+#define FLAG_CONTENT_CHECKSUM  0x04
+#define FLAG_DICTIONARY        0x01
+
+static void invalid (void)
+{
+  fatal("Invalid lz4 data on standard input");
+}
+
+static unsigned get32 (const unsigned char *p)
+{
+  return p[0] | p[1] << 8 | p[2] << 16 | (unsigned)p[3] << 24;
+}
+
+static void expect (int state, size_t n, unsigned char *data)
+{
+  in.state = state;
+  in.need = n;
+  in.have = 0;
+  in.data = data;
+}
+
+static size_t more_length (const unsigned char **ip, const unsigned char *iend)
+{
+  size_t n = 0;
+  unsigned c;
+
+  do
+    {
+      if (*ip >= iend)
+	invalid();
+      c = *(*ip)++;
+      n += c;
+    }
+  while (c == 255);
+
+  return n;
+}
+
+static void lz4_decode (const unsigned char *ip, size_t n)
+{
+  const unsigned char *iend = ip + n, *ref;
+  unsigned char *op = in.window + in.end, *oend = op + in.max;
+  size_t length, offset;
+  unsigned token;
+
+  for (;;)
+    {
+      if (ip >= iend)
+	invalid();
+      token = *ip++;
+      length = token >> 4;
+      if (length == 15)
+	length += more_length(&ip, iend);
+      if ((size_t)(iend - ip) < length || (size_t)(oend - op) < length)
+	invalid();
+      memcpy(op, ip, length);
+      ip += length;
+      op += length;
+
+      // The last sequence has no match.
+      if (ip == iend)
+	break;
+
+      if (iend - ip < 2)
+	invalid();
+      offset = ip[0] | ip[1] << 8;
+      ip += 2;
+      length = token & 15;
+      if (length == 15)
+	length += more_length(&ip, iend);
+      length += MIN_MATCH;
+      if (offset == 0 || offset > (size_t)(op - in.window)
+	  || (size_t)(oend - op) < length)
+	invalid();
+
+      // A match may overlap its own output.
+      ref = op - offset;
+      if (offset >= length)
+	{
+	  memcpy(op, ref, length);
+	  op += length;
+	}
+      else
+	while (length-- > 0)
+	  *op++ = *ref++;
+    }
+
+  in.end = op - in.window;
+}
+
+static void lz4_block_done (void)
+{
+  size_t shift;
+
+  if (in.end + in.max > in.room)
+    {
+      shift = in.end - HISTORY;
+      memmove(in.window, in.window + shift, HISTORY);
+      in.start = in.end = HISTORY;
+    }
+
+  if (in.size & 0x80000000)
+    {
+      memcpy(in.window + in.end, in.block, in.size & 0x7fffffff);
+      in.end += in.size & 0x7fffffff;
+    }
+  else
+    lz4_decode(in.block, in.size);
+}
+
+// A header field or block is complete.
+static void lz4_next (void)
+{
+  unsigned magic, n;
+
+  switch (in.state)
+    {
+    case MAGIC:
+      magic = get32(in.field);
+      if (magic == LZ4_MAGIC)
+	expect(DESCRIPTOR, 2, in.field);
+      else if ((magic & 0xfffffff0) == LZ4_SKIPPABLE)
+	expect(SKIP_SIZE, 4, in.field);
+      else
+	invalid();
+      break;
+
+    case DESCRIPTOR:
+      in.flags = in.field[0];
+      n = in.field[1] >> 4 & 7;
+      if (in.flags >> 6 != 1 || n < 4)
+	invalid();
+      in.max = (size_t)1 << (8 + 2 * n);
+
+      if (in.room < HISTORY + in.max)
+	{
+	  free(in.window);
+	  free(in.block);
+	  in.room = HISTORY + in.max;
+	  in.window = malloc(in.room);
+	  in.block = malloc(in.max);
+	  if (in.window == NULL || in.block == NULL)
+	    fatal("Out of memory");
+	  in.start = in.end = 0;
+	}
+
+      // The header checksum, after the content size and dictionary
+      // if there are any.
+      n = 1;
+      if (in.flags & FLAG_CONTENT_SIZE)
+	n += 8;
+      if (in.flags & FLAG_DICTIONARY)
+	n += 4;
+      expect(HEADER, n, in.field);
+      break;
+
+    case HEADER:
+    case BLOCK_CHECKSUM:
+      expect(SIZE, 4, in.field);
+      break;
+
+    case SIZE:
+      in.size = get32(in.field);
+      if (in.size == 0)
+	{
+	  // The end mark.  Another frame may follow.
+	  if (in.flags & FLAG_CONTENT_CHECKSUM)
+	    expect(SKIP, 4, NULL);
+	  else
+	    expect(MAGIC, 4, in.field);
+	}
+      else if ((in.size & 0x7fffffff) > in.max)
+	invalid();
+      else
+	expect(DATA, in.size & 0x7fffffff, in.block);
+      break;
+
+    case DATA:
+      lz4_block_done();
+      if (in.flags & FLAG_BLOCK_CHECKSUM)
+	expect(BLOCK_CHECKSUM, 4, in.field);
+      else
+	expect(SIZE, 4, in.field);
+      break;
+
+    case SKIP_SIZE:
+      expect(SKIP, get32(in.field), NULL);
+      break;
+
+    case SKIP:
+      expect(MAGIC, 4, in.field);
+      break;
+    }
+}
+
+// Pass on output held back.  Returns 0 if some is still left.
+static int lz4_deliver (struct ring *r)
+{
+  size_t n = in.end - in.start;
+
+  if (n > ring_room(r))
+    n = ring_room(r);
+  ring_put(r, (const char *)in.window + in.start, n);
+  in.start += n;
+
+  return in.start == in.end;
+}
+
+static size_t lz4_decompress (struct ring *r, const char *data, size_t n)
+{
+  size_t used = 0, length;
+
+  if (!lz4_deliver(r))
+    return 0;
+
+  while (used < n)
+    {
+      length = in.need - in.have;
+      if (length > n - used)
+	length = n - used;
+      if (in.data != NULL)
+	memcpy(in.data + in.have, data + used, length);
+      in.have += length;
+      used += length;
+
+      if (in.have == in.need)
+	{
+	  lz4_next();
+	  if (!lz4_deliver(r))
+	    break;
+	}
+    }
+
+  return used;
+}
+
+#ifdef HAVE_ZSTD
+static ZSTD_CCtx *cctx;
+static ZSTD_DCtx *dctx;
+
+static void zstd_check (size_t rc)
+{
+  if (ZSTD_isError(rc))
+    fatal("zstd error: %s", ZSTD_getErrorName(rc));
+}
+
+// Compress into the ring, which has room for everything.  Returns
+// what zstd has left to flush.
+static size_t zstd_put (struct ring *r, const char *data, size_t n,
+			ZSTD_EndDirective mode)
+{
+  ZSTD_inBuffer input = { data, n, 0 };
+  ZSTD_outBuffer output;
+  size_t rc;
+
+  do
+    {
+      output.dst = ring_space(r, &output.size);
+      output.pos = 0;
+      if (output.size == 0)
+	fatal("No room for compressed output");
+      rc = ZSTD_compressStream2(cctx, &output, &input, mode);
+      zstd_check(rc);
+      ring_produce(r, output.pos);
+    }
+  while (input.pos < input.size || (mode != ZSTD_e_continue && rc > 0));
+
+  return rc;
+}
+
+static size_t zstd_decompress (struct ring *r, const char *data, size_t n)
+{
+  ZSTD_inBuffer input = { data, n, 0 };
+  ZSTD_outBuffer output;
+
+  for (;;)
+    {
+      output.dst = ring_space(r, &output.size);
+      output.pos = 0;
+      if (output.size == 0)
+	break;
+      zstd_check(ZSTD_decompressStream(dctx, &output, &input));
+      ring_produce(r, output.pos);
+
+      // With room to spare, zstd has given all it can.
+      if (output.pos < output.size)
+	break;
+    }
+
+  return input.pos;
+}
+#endif
+
+void compress_init (const char *name)
+{
+  if (strcmp(name, "lz4") == 0)
+    {
+      codec = LZ4;
+      window = calloc(HISTORY + BLOCK, 1);
+      block = malloc(4 + BLOCK + BLOCK / 255 + 16);
+      if (window == NULL || block == NULL)
+	fatal("Out of memory");
+      expect(MAGIC, 4, in.field);
+    }
+#ifdef HAVE_ZSTD
+  else if (strcmp(name, "zstd") == 0)
+    {
+      codec = ZSTD;
+      cctx = ZSTD_createCCtx();
+      dctx = ZSTD_createDCtx();
+      if (cctx == NULL || dctx == NULL)
+	fatal("Out of memory");
+    }
+#endif
+  else
+    fatal("Unsupported compression: %s", name);
+}
+
+int compress_active (void)
+{
+  return codec != NONE;
+}
+
+// Both codecs add at most a byte in 255 or 256 to data that doesn't
+// compress, plus a few bytes per block.
+size_t compress_room (size_t room)
+{
+  size_t n = room - room / 128;
+
+  return n > held + SLACK ? n - held - SLACK : 0;
+}
+
+void compress_put (struct ring *r, const char *data, size_t n)
+{
+  held += n;
+  if (codec == LZ4)
+    lz4_put(r, data, n);
+#ifdef HAVE_ZSTD
+  else
+    zstd_put(r, data, n, ZSTD_e_continue);
+#endif
+}
+
+void compress_flush (struct ring *r)
+{
+  held = 0;
+  if (codec == LZ4)
+    lz4_flush(r);
+#ifdef HAVE_ZSTD
+  else
+    zstd_put(r, NULL, 0, ZSTD_e_flush);
+#endif
+}
+
+void compress_end (struct ring *r)
+{
+  held = 0;
+  if (codec == LZ4)
+    {
+      lz4_flush(r);
+      ring_put(r, "\0\0\0\0", 4);
+    }
+#ifdef HAVE_ZSTD
+  else
+    zstd_put(r, NULL, 0, ZSTD_e_end);
+#endif
+}
+
+void compress_reset (void)
+{
+  held = 0;
+  if (codec == LZ4)
+    {
+      started = 0;
+      start = end = 0;
+      memset(table, 0, sizeof table);
+      expect(MAGIC, 4, in.field);
+      in.start = in.end = 0;
+    }
+#ifdef HAVE_ZSTD
+  else
+    {
+      ZSTD_CCtx_reset(cctx, ZSTD_reset_session_only);
+      ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+    }
+#endif
+}
+
+size_t decompress (struct ring *r, const char *data, size_t n)
+{
+#ifdef HAVE_ZSTD
+  if (codec == ZSTD)
+    return zstd_decompress(r, data, n);
+#endif
+  return lz4_decompress(r, data, n);
+}
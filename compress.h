@@ -0,0 +1,37 @@
+/*
+ * Streaming compression of the program's output, and decompression of
+ * its input.
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include "ring.h"
+
+// Select lz4, or zstd if built with it.
+extern void compress_init (const char *name);
+extern int compress_active (void);
+
+// How many more bytes can be compressed into room bytes of output,
+// leaving enough for what's held back and the end of the stream.
+extern size_t compress_room (size_t room);
+
+// Compress n bytes into the ring.  Some may be held back for a bigger
+// block until compress_flush.
+extern void compress_put (struct ring *, const char *data, size_t n);
+
+// Put out everything so far, so the other side can decompress it.
+extern void compress_flush (struct ring *);
+extern void compress_end (struct ring *);
+
+// Start new streams both ways, for a new connection.
+extern void compress_reset (void);
+
+// Decompress data into the ring, as far as it has room.  Returns how
+// much was used, the rest must be given again.  Output that didn't fit
+// is held back, and goes out first on the next call, which may have n
+// 0 for just that.
+extern size_t decompress (struct ring *, const char *data, size_t n);
+
+#endif
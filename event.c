@@ -0,0 +1,509 @@
+/*
+ * Event engine backends: epoll on Linux, kqueue on the BSDs and macOS,
+ * and poll everywhere else.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include "pty-stdio.h"
+#include "event.h"
+
+#if defined(__linux__)
+#define HAVE_EPOLL
+#include <sys/epoll.h>
+#include <time.h>
+#endif
+
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) \
+  || defined(__OpenBSD__) || defined(__DragonFly__)
+#define HAVE_KQUEUE
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
+// What the engine knows about a registered file descriptor.  The
+// table is indexed by file descriptor.
+struct slot
+{
+  int events;
+  void *data;
+  int registered;
+  int index;   // Into the pollfd array, poll backend only.
+  int always;  // Not pollable, always reported as ready.
+};
+
+struct backend
+{
+  const char *name;
+  int (*init) (struct event_engine *);
+  void (*add) (struct event_engine *, int fd);
+  void (*modify) (struct event_engine *, int fd, int old_events);
+  void (*remove) (struct event_engine *, int fd);
+  int (*wait) (struct event_engine *, struct event *, int max, long timeout);
+};
+
+struct event_engine
+{
+  const struct backend *backend;
+  int fd;                // epoll or kqueue descriptor.
+  struct slot *table;
+  int table_size;
+  struct pollfd *pfd;    // Poll backend only.
+  int npfd;
+  int always;            // Number of slots with always set.
+};
+
+static struct slot *slot (struct event_engine *e, int fd)
+{
+  if (fd >= e->table_size)
+    {
+      int size = e->table_size ? e->table_size : 16;
+
+      while (size <= fd)
+	size *= 2;
+      e->table = realloc(e->table, size * sizeof *e->table);
+      if (e->table == NULL)
+	fatal("Out of memory");
+      memset(e->table + e->table_size, 0,
+	     (size - e->table_size) * sizeof *e->table);
+      e->table_size = size;
+    }
+
+  return &e->table[fd];
+}
+
+// Microseconds to milliseconds for poll and epoll_wait, rounding up so
+// as to not wake up early.
+static int milliseconds (long timeout)
+{
+  return timeout < 0 ? -1 : (timeout + 999) / 1000;
+}
+
+static void report (struct event *ev, int fd, int events, void *data)
+{
+  ev->fd = fd;
+  ev->events = events;
+  ev->data = data;
+}
+
+// Report descriptors that the kernel facility refused to watch, such
+// as regular files with epoll.  They are always ready.
+static int report_always (struct event_engine *e, struct event *ev, int max)
+{
+  int fd, n = 0;
+
+  for (fd = 0; fd < e->table_size && n < max; fd++)
+    {
+      struct slot *s = &e->table[fd];
+      if (s->always && s->events)
+	report(&ev[n++], fd, s->events & (EVENT_READ | EVENT_WRITE), s->data);
+    }
+
+  return n;
+}
+
+static int poll_init (struct event_engine *e)
+{
+  e->fd = -1;
+  return 0;
+}
+
+static short poll_mask (int events)
+{
+  short mask = 0;
+
+  if (events & EVENT_READ)
+    mask |= POLLIN;
+  if (events & EVENT_WRITE)
+    mask |= POLLOUT;
+
+  return mask;
+}
+
+// Hangups are reported even with no events asked for, so a file
+// descriptor nobody is waiting on is left out of the poll as ~fd.
+static void poll_set (struct event_engine *e, int fd)
+{
+  struct slot *s = slot(e, fd);
+  struct pollfd *p = &e->pfd[s->index];
+
+  p->events = poll_mask(s->events);
+  p->fd = p->events ? fd : ~fd;
+  p->revents = 0;
+}
+
+static void poll_add (struct event_engine *e, int fd)
+{
+  struct slot *s = slot(e, fd);
+
+  e->pfd = realloc(e->pfd, (e->npfd + 1) * sizeof *e->pfd);
+  if (e->pfd == NULL)
+    fatal("Out of memory");
+
+  s->index = e->npfd++;
+  poll_set(e, fd);
+}
+
+static void poll_modify (struct event_engine *e, int fd, int old_events)
+{
+  poll_set(e, fd);
+}
+
+static void poll_remove (struct event_engine *e, int fd)
+{
+  struct slot *s = slot(e, fd);
+  int last = --e->npfd, moved;
+
+  if (s->index != last)
+    {
+      e->pfd[s->index] = e->pfd[last];
+      moved = e->pfd[s->index].fd;
+      e->table[moved < 0 ? ~moved : moved].index = s->index;
+    }
+}
+
+static int poll_wait (struct event_engine *e, struct event *ev, int max,
+		      long timeout)
+{
+  int i, rc, n = 0;
+
+  rc = poll(e->pfd, e->npfd, milliseconds(timeout));
+  if (rc <= 0)
+    return rc;
+
+  for (i = 0; i < e->npfd && n < max; i++)
+    {
+      struct pollfd *p = &e->pfd[i];
+      struct slot *s;
+      int events = 0;
+
+      // Disabled entries have a negative fd, and never any events.
+      if (p->revents == 0)
+	continue;
+      s = &e->table[p->fd];
+      if (p->revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL))
+	events |= EVENT_READ;
+      if (p->revents & (POLLOUT | POLLERR | POLLNVAL))
+	events |= EVENT_WRITE;
+      events &= s->events;
+      if (events)
+	report(&ev[n++], p->fd, events, s->data);
+    }
+
+  return n;
+}
+
+static const struct backend poll_backend =
+{
+  "poll", poll_init, poll_add, poll_modify, poll_remove, poll_wait
+};
+
+#ifdef HAVE_EPOLL
+static int epoll_init (struct event_engine *e)
+{
+  e->fd = epoll_create1(EPOLL_CLOEXEC);
+  return e->fd;
+}
+
+static void epoll_control (struct event_engine *e, int op, int fd)
+{
+  struct slot *s = slot(e, fd);
+  struct epoll_event ee;
+
+  memset(&ee, 0, sizeof ee);
+  ee.data.fd = fd;
+  if (s->events & EVENT_READ)
+    ee.events |= EPOLLIN | EPOLLRDHUP;
+  if (s->events & EVENT_WRITE)
+    ee.events |= EPOLLOUT;
+  // Hangups are reported even with no events asked for.  Report them
+  // once, not on every wait.
+  if ((s->events & EVENT_EDGE) || ee.events == 0)
+    ee.events |= EPOLLET;
+
+  if (s->always)
+    return;
+
+  if (epoll_ctl(e->fd, op, fd, &ee) == -1)
+    {
+      // Regular files can't be watched, but are always ready.
+      if (errno == EPERM && op == EPOLL_CTL_ADD)
+	{
+	  s->always = 1;
+	  e->always++;
+	  return;
+	}
+      fatal("Error %d on epoll_ctl()", errno);
+    }
+}
+
+static void epoll_add (struct event_engine *e, int fd)
+{
+  epoll_control(e, EPOLL_CTL_ADD, fd);
+}
+
+static void epoll_modify (struct event_engine *e, int fd, int old_events)
+{
+  epoll_control(e, EPOLL_CTL_MOD, fd);
+}
+
+static void epoll_remove (struct event_engine *e, int fd)
+{
+  struct slot *s = slot(e, fd);
+
+  if (s->always)
+    {
+      s->always = 0;
+      e->always--;
+      return;
+    }
+
+  epoll_ctl(e->fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int epoll_wait_events (struct event_engine *e, struct event *ev,
+			      int max, long timeout)
+{
+  struct epoll_event ee[64];
+  int i, rc, n = 0;
+
+  // Don't wait if something is ready already.
+  if (e->always)
+    {
+      n = report_always(e, ev, max);
+      if (n > 0)
+	timeout = 0;
+    }
+
+  if (max - n < 64)
+    rc = max - n;
+  else
+    rc = 64;
+  if (rc == 0)
+    return n;
+
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+  // Microsecond resolution where the kernel has it.
+  if (timeout > 0)
+    {
+      struct timespec ts;
+      int size = rc;
+
+      ts.tv_sec = timeout / 1000000;
+      ts.tv_nsec = (timeout % 1000000) * 1000;
+      rc = epoll_pwait2(e->fd, ee, size, &ts, NULL);
+      if (rc < 0 && errno == ENOSYS)
+	rc = epoll_wait(e->fd, ee, size, milliseconds(timeout));
+    }
+  else
+#endif
+    rc = epoll_wait(e->fd, ee, rc, milliseconds(timeout));
+  if (rc < 0)
+    return n ? n : rc;
+
+  for (i = 0; i < rc; i++)
+    {
+      struct slot *s = &e->table[ee[i].data.fd];
+      int events = 0;
+
+      if (ee[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+	events |= EVENT_READ;
+      if (ee[i].events & (EPOLLOUT | EPOLLERR))
+	events |= EVENT_WRITE;
+      events &= s->events;
+      if (events)
+	report(&ev[n++], ee[i].data.fd, events, s->data);
+    }
+
+  return n;
+}
+
+static const struct backend epoll_backend =
+{
+  "epoll", epoll_init, epoll_add, epoll_modify, epoll_remove,
+  epoll_wait_events
+};
+#endif
+
+#ifdef HAVE_KQUEUE
+static int kqueue_init (struct event_engine *e)
+{
+  e->fd = kqueue();
+  return e->fd;
+}
+
+static void kqueue_control (struct event_engine *e, int fd, int old_events)
+{
+  struct slot *s = slot(e, fd);
+  struct kevent ke[2];
+  int n = 0;
+  u_short clear = (s->events & EVENT_EDGE) ? EV_CLEAR : 0;
+
+  if (s->events & EVENT_READ)
+    EV_SET(&ke[n++], fd, EVFILT_READ, EV_ADD | clear, 0, 0, NULL);
+  else if (old_events & EVENT_READ)
+    EV_SET(&ke[n++], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+
+  if (s->events & EVENT_WRITE)
+    EV_SET(&ke[n++], fd, EVFILT_WRITE, EV_ADD | clear, 0, 0, NULL);
+  else if (old_events & EVENT_WRITE)
+    EV_SET(&ke[n++], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+
+  if (n > 0 && kevent(e->fd, ke, n, NULL, 0, NULL) == -1)
+    fatal("Error %d on kevent()", errno);
+}
+
+static void kqueue_add (struct event_engine *e, int fd)
+{
+  kqueue_control(e, fd, 0);
+}
+
+static void kqueue_modify (struct event_engine *e, int fd, int old_events)
+{
+  kqueue_control(e, fd, old_events);
+}
+
+static void kqueue_remove (struct event_engine *e, int fd)
+{
+  struct slot *s = slot(e, fd);
+  int old_events = s->events;
+
+  s->events = 0;
+  kqueue_control(e, fd, old_events);
+}
+
+static int kqueue_wait (struct event_engine *e, struct event *ev, int max,
+			long timeout)
+{
+  struct kevent ke[64];
+  struct timespec ts, *tsp = NULL;
+  int i, rc, n = 0;
+
+  if (timeout >= 0)
+    {
+      ts.tv_sec = timeout / 1000000;
+      ts.tv_nsec = (timeout % 1000000) * 1000;
+      tsp = &ts;
+    }
+
+  rc = kevent(e->fd, NULL, 0, ke, max < 64 ? max : 64, tsp);
+  if (rc < 0)
+    return rc;
+
+  for (i = 0; i < rc; i++)
+    {
+      int fd = ke[i].ident;
+      struct slot *s = &e->table[fd];
+      int events;
+
+      if (ke[i].filter == EVFILT_WRITE)
+	events = EVENT_WRITE;
+      else
+	events = EVENT_READ;
+      events &= s->events;
+      if (events)
+	report(&ev[n++], fd, events, s->data);
+    }
+
+  return n;
+}
+
+static const struct backend kqueue_backend =
+{
+  "kqueue", kqueue_init, kqueue_add, kqueue_modify, kqueue_remove,
+  kqueue_wait
+};
+#endif
+
+// In order of preference.
+static const struct backend *backends[] =
+{
+#ifdef HAVE_EPOLL
+  &epoll_backend,
+#endif
+#ifdef HAVE_KQUEUE
+  &kqueue_backend,
+#endif
+  &poll_backend,
+  NULL
+};
+
+// Open an event engine.  With a NULL name, pick the best backend that
+// works on this system.
+struct event_engine *event_open (const char *name)
+{
+  struct event_engine *e;
+  int i;
+
+  e = calloc(1, sizeof *e);
+  if (e == NULL)
+    fatal("Out of memory");
+
+  for (i = 0; backends[i] != NULL; i++)
+    {
+      if (name != NULL && strcmp(name, backends[i]->name) != 0)
+	continue;
+      e->backend = backends[i];
+      if (e->backend->init(e) >= 0)
+	return e;
+      if (name != NULL)
+	fatal("Error %d initializing %s event engine", errno, name);
+    }
+
+  if (name != NULL)
+    fatal("Unknown event engine: %s", name);
+  fatal("No usable event engine");
+  return NULL;
+}
+
+const char *event_name (struct event_engine *e)
+{
+  return e->backend->name;
+}
+
+void event_add (struct event_engine *e, int fd, int events, void *data)
+{
+  struct slot *s = slot(e, fd);
+
+  s->events = events;
+  s->data = data;
+  s->always = 0;
+  s->registered = 1;
+  e->backend->add(e, fd);
+}
+
+void event_modify (struct event_engine *e, int fd, int events, void *data)
+{
+  struct slot *s = slot(e, fd);
+  int old_events = s->events;
+
+  s->data = data;
+  if (events == old_events)
+    return;
+  s->events = events;
+  e->backend->modify(e, fd, old_events);
+}
+
+void event_remove (struct event_engine *e, int fd)
+{
+  struct slot *s = slot(e, fd);
+
+  if (!s->registered)
+    return;
+  e->backend->remove(e, fd);
+  s->events = 0;
+  s->data = NULL;
+  s->registered = 0;
+}
+
+// Wait for events, at most max of them.  The timeout is in
+// microseconds, or -1 to wait forever.  Returns the number of events,
+// or -1 with errno set.
+int event_wait (struct event_engine *e, struct event *ev, int max,
+		long timeout)
+{
+  return e->backend->wait(e, ev, max, timeout);
+}
@@ -0,0 +1,36 @@
+/*
+ * Event engine: wait for readiness on a set of file descriptors.
+ *
+ * File descriptors are registered once and stay registered until
+ * removed, so a wakeup costs a single system call with the epoll and
+ * kqueue backends.
+ */
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#define EVENT_READ   1
+#define EVENT_WRITE  2
+// Edge-triggered notification.  The caller must drain the file
+// descriptor until EAGAIN.  Backends that can't do this fall back to
+// level-triggered, which is always safe for a draining caller.
+#define EVENT_EDGE   4
+
+struct event
+{
+  int fd;
+  int events;
+  void *data;
+};
+
+struct event_engine;
+
+extern struct event_engine *event_open (const char *name);
+extern const char *event_name (struct event_engine *);
+extern void event_add (struct event_engine *, int fd, int events, void *data);
+extern void event_modify (struct event_engine *, int fd, int events, void *data);
+extern void event_remove (struct event_engine *, int fd);
+extern int event_wait (struct event_engine *, struct event *, int max,
+		       long timeout);
+
+#endif
@@ -0,0 +1,344 @@
+/*
+ * Triggers on the program's output.
+ *
+ * Each line of the trigger file is a pattern and a response separated
+ * by a tab, both with C escapes like \r and \x1b.  A pattern starting
+ * with ~ is an extended regular expression matched within a line,
+ * others are literal strings.  Lines starting with # are comments.
+ *
+ * The literals are compiled into one Aho-Corasick automaton with the
+ * full transition table, so matching is a table lookup per byte and
+ * carries over from one read to the next.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <regex.h>
+#include "pty-stdio.h"
+#include "expect.h"
+
+// Regular expressions see at most this much of a line.
+#define LINE_SIZE 4096
+
+struct trigger
+{
+  char *pattern, *response;
+  size_t pattern_length, response_length;
+  int is_regex;
+  regex_t regex;
+  int next;  // Next literal trigger ending in the same state, or -1.
+};
+
+static struct trigger *triggers;
+static int ntriggers;
+static int regexes;
+
+// The automaton.  State 0 is the root.
+static int (*delta)[256];
+static int *output;    // First trigger matching in this state, or -1.
+static int *dict;      // Nearest suffix state with output, or 0.
+static int nstates;
+static int state;
+
+static char line[LINE_SIZE + 1];
+static size_t line_length;
+static int line_cut;   // The start of the line is used up or dropped.
+
+static int hex (int c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// Undo C escapes in place.  Returns the new length.
+static size_t unescape (char *s)
+{
+  char *in = s, *out = s;
+
+  while (*in)
+    {
+      if (*in != '\\' || in[1] == 0)
+	{
+	  *out++ = *in++;
+	  continue;
+	}
+      in++;
+      switch (*in)
+	{
+	case 'a': *out++ = '\a'; in++; break;
+	case 'b': *out++ = '\b'; in++; break;
+	case 'e': *out++ = 033; in++; break;
+	case 'n': *out++ = '\n'; in++; break;
+	case 'r': *out++ = '\r'; in++; break;
+	case 't': *out++ = '\t'; in++; break;
+	case 'x':
+	  if (hex(in[1]) >= 0 && hex(in[2]) >= 0)
+	    {
+	      *out++ = hex(in[1]) << 4 | hex(in[2]);
+	      in += 3;
+	      break;
+	    }
+	  /* Fall through. */
+	default:
+	  *out++ = *in++;
+	  break;
+	}
+    }
+
+  *out = 0;
+  return out - s;
+}
+
+static int new_state (void)
+{
+  int c;
+
+  delta = realloc(delta, (nstates + 1) * sizeof *delta);
+  output = realloc(output, (nstates + 1) * sizeof *output);
+  dict = realloc(dict, (nstates + 1) * sizeof *dict);
+  if (delta == NULL || output == NULL || dict == NULL)
+    fatal("Out of memory");
+
+  for (c = 0; c < 256; c++)
+    delta[nstates][c] = -1;
+  output[nstates] = -1;
+  dict[nstates] = 0;
+  return nstates++;
+}
+
+static void insert (int index)
+{
+  struct trigger *t = &triggers[index];
+  unsigned char c;
+  size_t i;
+  int s = 0;
+
+  for (i = 0; i < t->pattern_length; i++)
+    {
+      c = t->pattern[i];
+      if (delta[s][c] == -1)
+	{
+	  int n = new_state();
+	  delta[s][c] = n;
+	}
+      s = delta[s][c];
+    }
+
+  t->next = output[s];
+  output[s] = index;
+}
+
+// Breadth first, fill in the missing transitions from the failure
+// states, which are always done before.
+static void compile (void)
+{
+  int *queue, *fail, head = 0, tail = 0, s, c, n;
+
+  queue = malloc(nstates * sizeof *queue);
+  fail = calloc(nstates, sizeof *fail);
+  if (queue == NULL || fail == NULL)
+    fatal("Out of memory");
+
+  for (c = 0; c < 256; c++)
+    {
+      n = delta[0][c];
+      if (n == -1)
+	delta[0][c] = 0;
+      else
+	queue[tail++] = n;
+    }
+
+  while (head < tail)
+    {
+      s = queue[head++];
+      dict[s] = output[fail[s]] != -1 ? fail[s] : dict[fail[s]];
+      for (c = 0; c < 256; c++)
+	{
+	  n = delta[s][c];
+	  if (n == -1)
+	    delta[s][c] = delta[fail[s]][c];
+	  else
+	    {
+	      fail[n] = delta[fail[s]][c];
+	      queue[tail++] = n;
+	    }
+	}
+    }
+
+  free(queue);
+  free(fail);
+}
+
+int expect_active (void)
+{
+  return config.expect != NULL;
+}
+
+void expect_init (const char *path)
+{
+  FILE *f;
+  char *text = NULL, *tab;
+  size_t size = 0;
+  ssize_t n;
+  int i, rc;
+
+  f = fopen(path, "r");
+  if (f == NULL)
+    fatal("Error %d on open %s", errno, path);
+
+  while ((n = getline(&text, &size, f)) != -1)
+    {
+      struct trigger *t;
+
+      if (n > 0 && text[n - 1] == '\n')
+	text[--n] = 0;
+      if (n == 0 || text[0] == '#')
+	continue;
+      tab = strchr(text, '\t');
+      if (tab == NULL || tab == text)
+	fatal("Invalid trigger in %s: %s", path, text);
+      *tab++ = 0;
+
+      triggers = realloc(triggers, (ntriggers + 1) * sizeof *triggers);
+      if (triggers == NULL)
+	fatal("Out of memory");
+      t = &triggers[ntriggers++];
+
+      t->is_regex = text[0] == '~';
+      t->pattern = strdup(text + t->is_regex);
+      t->response = strdup(tab);
+      if (t->pattern == NULL || t->response == NULL)
+	fatal("Out of memory");
+      t->response_length = unescape(t->response);
+
+      if (t->is_regex)
+	{
+	  // Left to regcomp, which knows its own escapes.
+	  rc = regcomp(&t->regex, t->pattern, REG_EXTENDED);
+	  if (rc != 0)
+	    fatal("Invalid regular expression in %s: %s", path, t->pattern);
+
+	  // It would match every line, over and over.
+	  if (regexec(&t->regex, "", 0, NULL, 0) == 0)
+	    fatal("Regular expression matches the empty string in %s: %s",
+		  path, t->pattern);
+	  regexes++;
+	}
+      else
+	t->pattern_length = unescape(t->pattern);
+      t->next = -1;
+    }
+
+  free(text);
+  fclose(f);
+
+  new_state();
+  for (i = 0; i < ntriggers; i++)
+    if (!triggers[i].is_regex && triggers[i].pattern_length > 0)
+      insert(i);
+  compile();
+}
+
+// Run the regular expressions on the line so far, which is complete
+// once its newline is in.  A match uses up the line up to its end, or
+// all of it if the match is empty, so it doesn't fire again on the
+// same line.  ^ only matches where the line really starts, and $ where
+// it really ends.
+static void match_line (void (*send) (const char *, size_t), int complete)
+{
+  regmatch_t m;
+  int i, flags;
+
+  for (i = 0; i < ntriggers; i++)
+    {
+      struct trigger *t = &triggers[i];
+
+      flags = (line_cut ? REG_NOTBOL : 0) | (complete ? 0 : REG_NOTEOL);
+      if (!t->is_regex || regexec(&t->regex, line, 1, &m, flags) != 0)
+	continue;
+
+      send(t->response, t->response_length);
+      if (m.rm_eo == 0)
+	m.rm_eo = line_length;
+      line_length -= m.rm_eo;
+      memmove(line, line + m.rm_eo, line_length + 1);
+      line_cut = 1;
+    }
+}
+
+static void scan_lines (const char *data, size_t n,
+			void (*send) (const char *, size_t))
+{
+  const char *end = data + n, *newline;
+  size_t length;
+
+  while (data < end)
+    {
+      newline = memchr(data, '\n', end - data);
+      length = (newline ? newline : end) - data;
+
+      // Keep the end of a long line.
+      if (length > LINE_SIZE)
+	{
+	  data += length - LINE_SIZE;
+	  length = LINE_SIZE;
+	  line_cut = 1;
+	}
+      if (line_length + length > LINE_SIZE)
+	{
+	  size_t drop = line_length + length - LINE_SIZE;
+	  memmove(line, line + drop, line_length - drop);
+	  line_length -= drop;
+	  line_cut = 1;
+	}
+
+      memcpy(line + line_length, data, length);
+      line_length += length;
+      line[line_length] = 0;
+      // A NUL byte would end the string early.
+      line_length = strlen(line);
+
+      // The pty ends lines with \r\n, and $ is for the end of the text.
+      if (newline != NULL && line_length > 0 && line[line_length - 1] == '\r')
+	line[--line_length] = 0;
+
+      match_line(send, newline != NULL);
+
+      if (newline == NULL)
+	break;
+      line_length = 0;
+      line_cut = 0;
+      data = newline + 1;
+    }
+}
+
+void expect_scan (const char *data, size_t n,
+		  void (*send) (const char *, size_t))
+{
+  const unsigned char *p = (const unsigned char *)data;
+  size_t i;
+  int s = state, t, j;
+
+  if (nstates > 1)
+    {
+      for (i = 0; i < n; i++)
+	{
+	  s = delta[s][p[i]];
+	  for (t = s; t != 0; t = dict[t])
+	    for (j = output[t]; j != -1; j = triggers[j].next)
+	      send(triggers[j].response, triggers[j].response_length);
+	}
+      state = s;
+    }
+
+  if (regexes)
+    scan_lines(data, n, send);
+}
@@ -0,0 +1,19 @@
+/*
+ * Answer the program's output: when a trigger matches, a response is
+ * sent to the program as if typed.
+ */
+
+#ifndef EXPECT_H
+#define EXPECT_H
+
+#include <stddef.h>
+
+// Read triggers from a file.  Active with config.expect.
+extern void expect_init (const char *path);
+extern int expect_active (void);
+
+// Scan output, and pass the responses to send.
+extern void expect_scan (const char *data, size_t n,
+			 void (*send) (const char *, size_t));
+
+#endif
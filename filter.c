@@ -0,0 +1,220 @@
+/*
+ * Escape sequence filter, following the ECMA-48 syntax closely enough
+ * for terminal output.  Plain text is found with memchr, which the C
+ * library vectorizes, and moved in spans.  The parser state carries
+ * over between chunks, so a sequence split by a read is still caught.
+ *
+ * A sequence that might be kept is held back until it's known.  That
+ * is only a lone ESC, or a control sequence when SGR is removed but
+ * not the others.  One still held when the output ends is lost.
+ */
+
+#include <string.h>
+#include "pty-stdio.h"
+#include "filter.h"
+
+#define ESC 033
+#define BEL 007
+
+#define F_SGR 1
+#define F_CSI 2
+#define F_OSC 4
+#define F_ESC 8
+
+enum { GROUND, ESCAPE, ESCAPE_INTERMEDIATE, CSI, STRING, STRING_ESCAPE };
+enum { HOLD, KEEP, DROP };
+
+static int state = GROUND;
+static int mode;
+static unsigned char held[FILTER_ROOM];
+static size_t nheld;
+
+int filter_parse (const char *list)
+{
+  const char *p = list, *end;
+  int remove = 0;
+  size_t n;
+
+  while (*p)
+    {
+      end = strchr(p, ',');
+      n = end ? (size_t)(end - p) : strlen(p);
+
+      if (n == 3 && strncmp(p, "sgr", 3) == 0)
+	remove |= F_SGR;
+      else if (n == 3 && strncmp(p, "csi", 3) == 0)
+	remove |= F_CSI | F_SGR;
+      else if (n == 3 && strncmp(p, "osc", 3) == 0)
+	remove |= F_OSC;
+      else if (n == 3 && strncmp(p, "esc", 3) == 0)
+	remove |= F_ESC;
+      else if (n == 3 && strncmp(p, "all", 3) == 0)
+	remove |= F_SGR | F_CSI | F_OSC | F_ESC;
+      else
+	fatal("Invalid filter: %s", list);
+
+      p += n;
+      if (*p == ',')
+	p++;
+    }
+
+  return remove;
+}
+
+int filter_active (void)
+{
+  return config.filter != 0;
+}
+
+// Settle what to do with the sequence so far.
+static size_t decide (unsigned char *out, size_t w, int drop)
+{
+  if (mode != HOLD)
+    return w;
+
+  mode = drop ? DROP : KEEP;
+  if (mode == KEEP)
+    {
+      memcpy(out + w, held, nheld);
+      w += nheld;
+    }
+  nheld = 0;
+  return w;
+}
+
+static size_t put (unsigned char *out, size_t w, int c)
+{
+  if (mode == KEEP)
+    out[w++] = c;
+  else if (mode == HOLD)
+    {
+      // Too long to be a real sequence, let it through.
+      if (nheld == sizeof held)
+	{
+	  w = decide(out, w, 0);
+	  out[w++] = c;
+	}
+      else
+	held[nheld++] = c;
+    }
+
+  return w;
+}
+
+size_t filter_apply (char *data, size_t n)
+{
+  unsigned char *out = (unsigned char *)data;
+  unsigned char *in = out + FILTER_ROOM, *end = in + n, *esc;
+  size_t w = 0, length;
+  int c;
+
+  while (in < end)
+    {
+      if (state == GROUND)
+	{
+	  esc = memchr(in, ESC, end - in);
+	  length = (esc ? esc : end) - in;
+	  memmove(out + w, in, length);
+	  w += length;
+	  in += length;
+	  if (esc == NULL)
+	    break;
+
+	  in++;
+	  state = ESCAPE;
+	  mode = HOLD;
+	  nheld = 0;
+	  w = put(out, w, ESC);
+	  continue;
+	}
+
+      c = *in++;
+      switch (state)
+	{
+	case ESCAPE:
+	  if (c == '[')
+	    {
+	      state = CSI;
+	      if (config.filter & F_CSI)
+		w = decide(out, w, 1);
+	      else if (!(config.filter & F_SGR))
+		w = decide(out, w, 0);
+	    }
+	  else if (c == ']' || c == 'P' || c == 'X' || c == '^' || c == '_')
+	    {
+	      state = STRING;
+	      w = decide(out, w, config.filter & F_OSC);
+	    }
+	  else if (c >= 0x20 && c <= 0x2f)
+	    {
+	      state = ESCAPE_INTERMEDIATE;
+	      w = decide(out, w, config.filter & F_ESC);
+	    }
+	  else if (c >= 0x30 && c <= 0x7e)
+	    {
+	      state = GROUND;
+	      w = decide(out, w, config.filter & F_ESC);
+	    }
+	  else
+	    {
+	      // Not a sequence after all.  Look at this byte again.
+	      w = decide(out, w, config.filter & F_ESC);
+	      state = GROUND;
+	      in--;
+	      continue;
+	    }
+	  w = put(out, w, c);
+	  break;
+
+	case ESCAPE_INTERMEDIATE:
+	  if (c >= 0x20 && c <= 0x7e)
+	    {
+	      w = put(out, w, c);
+	      if (c >= 0x30)
+		state = GROUND;
+	    }
+	  else
+	    {
+	      state = GROUND;
+	      in--;
+	    }
+	  break;
+
+	case CSI:
+	  if (c >= 0x20 && c <= 0x3f)
+	    w = put(out, w, c);
+	  else if (c >= 0x40 && c <= 0x7e)
+	    {
+	      w = decide(out, w, c == 'm');
+	      w = put(out, w, c);
+	      state = GROUND;
+	    }
+	  else
+	    {
+	      // Cut short, by a control character or a new sequence.
+	      w = decide(out, w, 0);
+	      state = GROUND;
+	      in--;
+	    }
+	  break;
+
+	case STRING:
+	  w = put(out, w, c);
+	  if (c == BEL)
+	    state = GROUND;
+	  else if (c == ESC)
+	    state = STRING_ESCAPE;
+	  break;
+
+	case STRING_ESCAPE:
+	  w = put(out, w, c);
+	  if (c == '\\')
+	    state = GROUND;
+	  else if (c != ESC)
+	    state = STRING;
+	  break;
+	}
+    }
+
+  return w;
+}
@@ -0,0 +1,25 @@
+/*
+ * Filter escape sequences out of the program's output.
+ */
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stddef.h>
+
+// Room the filter needs in front of the data it filters, for a
+// sequence held back from the previous chunk.
+#define FILTER_ROOM 64
+
+// What to remove, for config.filter, from a comma separated list of
+// sgr (colours and attributes), csi (all control sequences), osc
+// (operating system commands, and other strings like DCS), esc (other
+// escapes), or all.
+extern int filter_parse (const char *list);
+extern int filter_active (void);
+
+// Filter n bytes at data + FILTER_ROOM, leaving the result at data.
+// Returns its length.
+extern size_t filter_apply (char *data, size_t n);
+
+#endif
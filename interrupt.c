@@ -0,0 +1,70 @@
+/*
+ * Interrupts.  A SIGINT to pty-stdio, or the interrupt character on
+ * standard input with --interrupt, reaches the program at once, ahead
+ * of any output still to be written and any input it hasn't read.
+ * Everything here is safe to call from a signal handler.
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <termios.h>
+#include "pty-stdio.h"
+#include "interrupt.h"
+
+static int pty = -1;
+
+static void handler (int sig)
+{
+  int saved = errno;
+
+  interrupt_send(pty);
+  errno = saved;
+}
+
+void interrupt_forward (int fdm)
+{
+  struct sigaction sa;
+
+  pty = fdm;
+
+  // Restart system calls, there's nothing for the loop to do.
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = handler;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+}
+
+size_t interrupt_find (int fdm, const char *data, size_t n)
+{
+  struct termios t;
+
+  if (tcgetattr(fdm, &t) == -1
+      || !(t.c_lflag & ISIG) || (t.c_lflag & NOFLSH)
+      || t.c_cc[VINTR] == _POSIX_VDISABLE)
+    return 0;
+
+  while (n > 0 && data[n - 1] != (char)t.c_cc[VINTR])
+    n--;
+  return n;
+}
+
+void interrupt_send (int fdm)
+{
+  struct pollfd p = { fdm, POLLOUT, 0 };
+  struct termios t;
+  pid_t group;
+
+  if (tcgetattr(fdm, &t) == 0 && (t.c_lflag & ISIG)
+      && t.c_cc[VINTR] != _POSIX_VDISABLE
+      && poll(&p, 1, 0) == 1 && (p.revents & POLLOUT)
+      && write(fdm, &t.c_cc[VINTR], 1) == 1)
+    return;
+
+  group = tcgetpgrp(fdm);
+  if (group > 0)
+    kill(-group, SIGINT);
+}
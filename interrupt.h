@@ -0,0 +1,23 @@
+/*
+ * Interrupt the program, not pty-stdio.
+ */
+
+#ifndef INTERRUPT_H
+#define INTERRUPT_H
+
+#include <stddef.h>
+
+// Pass SIGINT on to the program on the pty instead of exiting.
+extern void interrupt_forward (int fdm);
+
+// Where the input would interrupt the program: one past the last
+// interrupt character in data, or 0.  Only when the pty turns it into
+// a signal and discards the input before it.
+extern size_t interrupt_find (int fdm, const char *data, size_t n);
+
+// Interrupt the program now.  The interrupt character goes to the pty
+// if it has room, so it's echoed and the line discipline does the
+// rest, otherwise the foreground process group gets SIGINT.
+extern void interrupt_send (int fdm);
+
+#endif
@@ -0,0 +1,113 @@
+/*
+ * Line prefixes for the program's output.  Line ends are found with
+ * memchr, which the C library vectorizes, and each line is copied out
+ * with its prefix in front, so a whole read still leaves in one
+ * writev.  The prefix is made once per read, as all of its lines came
+ * in at the same time.  A line split between reads gets its prefix
+ * when it starts.
+ *
+ * The copy is on purpose.  Prefixes as iovecs of their own would take
+ * two per line, so a read of short lines would need many writev calls
+ * of at most IOV_MAX each, and the stages after this one, scrollback
+ * and compression, and the shared memory ring all want the prefixed
+ * bytes in one piece.
+ *
+ * Timestamps are UTC, in ISO 8601 form with microseconds.
+ */
+
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "pty-stdio.h"
+#include "lines.h"
+
+// "2026-01-31T23:59:59.123456Z"
+#define STAMP_LENGTH 27
+
+static char *prefix;           // Timestamp, tag, each followed by a space.
+static size_t length;
+static time_t second = -1;     // The prefix has the date and time for this.
+static int start = 1;          // The next byte starts a line.
+
+void lines_init (void)
+{
+  const char *tag = config.tag;
+  int on = config.timestamps;
+  size_t n = tag != NULL ? strlen(tag) + 1 : 0;
+
+  length = (on ? STAMP_LENGTH + 1 : 0) + n;
+  prefix = malloc(length);
+  if (prefix == NULL)
+    fatal("Out of memory");
+
+  if (on)
+    prefix[STAMP_LENGTH] = ' ';
+  if (tag != NULL)
+    {
+      memcpy(prefix + length - n, tag, n - 1);
+      prefix[length - 1] = ' ';
+    }
+}
+
+int lines_active (void)
+{
+  return config.timestamps || config.tag != NULL;
+}
+
+// Every byte could start a line.
+size_t lines_room (size_t n)
+{
+  return n * (length + 1);
+}
+
+static void stamp (void)
+{
+  struct timespec ts;
+  struct tm tm;
+  long usec;
+  int i;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  if (ts.tv_sec != second)
+    {
+      second = ts.tv_sec;
+      gmtime_r(&second, &tm);
+      strftime(prefix, STAMP_LENGTH, "%Y-%m-%dT%H:%M:%S.", &tm);
+    }
+
+  usec = ts.tv_nsec / 1000;
+  for (i = STAMP_LENGTH - 2; i >= STAMP_LENGTH - 7; i--)
+    {
+      prefix[i] = '0' + usec % 10;
+      usec /= 10;
+    }
+  prefix[STAMP_LENGTH - 1] = 'Z';
+}
+
+size_t lines_apply (char *out, const char *data, size_t n)
+{
+  const char *end = data + n, *eol;
+  char *op = out;
+
+  if (config.timestamps && n > 0)
+    stamp();
+
+  while (data < end)
+    {
+      if (start)
+	{
+	  memcpy(op, prefix, length);
+	  op += length;
+	}
+
+      eol = memchr(data, '\n', end - data);
+      start = eol != NULL;
+      eol = eol != NULL ? eol + 1 : end;
+      memcpy(op, data, eol - data);
+      op += eol - data;
+      data = eol;
+    }
+
+  return op - out;
+}
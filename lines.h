@@ -0,0 +1,22 @@
+/*
+ * Prefix each line of the program's output with a timestamp, a tag,
+ * or both.
+ */
+
+#ifndef LINES_H
+#define LINES_H
+
+#include <stddef.h>
+
+// Make the prefix for config.timestamps and config.tag.
+extern void lines_init (void);
+extern int lines_active (void);
+
+// Most output n bytes of input can make.
+extern size_t lines_room (size_t n);
+
+// Copy n bytes to out with a prefix at the start of each line, and
+// return the length.  Out must have room for lines_room(n) bytes.
+extern size_t lines_apply (char *out, const char *data, size_t n);
+
+#endif
@@ -5,6 +5,7 @@
  * Originally by Rachid Koucha.  Enhanced by Lars Brinhoff.
  */
 
+#define _GNU_SOURCE
 #define _XOPEN_SOURCE 600
 #define _BSD_SOURCE
 #include <stdlib.h>
@@ -14,27 +15,58 @@
 #include <stdio.h>
 #define __USE_BSD
 #include <termios.h>
-#include <sys/select.h>
 #include <sys/ioctl.h>
 #include <string.h>
 #include <stdarg.h>
 #include <signal.h>
-
+#include <getopt.h>
+#include <time.h>
+#include <spawn.h>
+#include "pty-stdio.h"
+#include "relay.h"
+#include "pool.h"
+#include "record.h"
+#include "filter.h"
+#include "compress.h"
+#include "net.h"
+#include "shm.h"
+#include "resize.h"
+#include "child.h"
+#include "interrupt.h"
+#include "rate.h"
+#include "tail.h"
+
+// Linux makes a tty the controlling terminal of a session leader that
+// opens it, so posix_spawn can set up the child without fork.
+#if defined(__linux__) && defined(POSIX_SPAWN_SETSID)
+#define HAVE_SPAWN_SETSID
+#endif
 
 static struct termios old_termios;
 static int fd_termios;
+static int size_cols, size_rows;  // From --size, or 0.
 
-static void cleanup (void)
+struct config config =
 {
-  tcsetattr (fd_termios, TCSANOW, &old_termios);
-}
+  64 * 1024,  // buffer_size
+  0,          // drain
+  0,          // splice
+  NULL,       // engine
+  0,          // multiplex
+  0,          // coalesce
+  1000,       // coalesce_usec
+  NULL,       // stats
+  NULL,       // pool
+  NULL,       // record
+  NULL,       // expect
+};
 
-static void handler (int sig)
+static void cleanup (void)
 {
-  exit(0);
+  tcsetattr (fd_termios, TCSANOW, &old_termios);
 }
 
-static void fatal (const char *message, ...)
+void fatal (const char *message, ...)
 {
   va_list args;
 
@@ -43,14 +75,23 @@ static void fatal (const char *message, ...)
   fputc('\n', stderr);
   va_end(args);
 
+  tail_dump();
   exit(1);
 }
 
+long long monotonic_usec (void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
 static int open_master (void)
 {
   int rc, fdm;
 
-  fdm = posix_openpt(O_RDWR);
+  fdm = posix_openpt(O_RDWR | O_NOCTTY);
   if (fdm < 0)
     fatal("Error %d on posix_openpt()", errno);
 
@@ -62,55 +103,63 @@ static int open_master (void)
   if (rc != 0)
     fatal("Error %d on unlockpt()", errno);
 
+  // Other children must not hold on to this pty
+  fcntl(fdm, F_SETFD, FD_CLOEXEC);
+
   return fdm;
 }
 
-static void read_write (const char *name, int in, int out)
+// Open a pty pair, from the pool server if there is one.  Returns the
+// master side, and the slave side in *fds.
+int open_pty (int *fds)
 {
-  char input[150];
-  int rc;
+  int fdm;
 
-  rc = read(in, input, sizeof input);
-  if (rc < 0)
-    {
-      if (errno == EIO)
-	exit (0);
+  if (config.pool != NULL && (fdm = pool_get(config.pool, fds)) != -1)
+    return fdm;
 
-      fatal("Error %d on read %s", errno, name);
-    }
+  // The slave side is for the program.  A session leader with no
+  // terminal, such as a daemonized pool server, would otherwise take
+  // it as its own, and get SIGHUP when it's hung up.
+  fdm = open_master();
+  *fds = open(ptsname(fdm), O_RDWR | O_NOCTTY);
+  if (*fds == -1)
+    fatal("Error %d on open()", errno);
 
-  write(out, input, rc);
+  return fdm;
 }
 
 static void terminal_settings(int fdm)
 {
   struct termios new_termios;
-  struct winsize ws;
   int rc;
 
-  if (isatty(0))
-    fd_termios = 0;
-  else if (isatty(1))
-    fd_termios = 1;
-  else
-    return;
+  fd_termios = isatty(0) ? 0 : isatty(1) ? 1 : -1;
 
-  // Copy terminal size to the pty.
-  ioctl(fd_termios, TIOCGWINSZ, &ws);
-  ioctl(fdm, TIOCSWINSZ, &ws);
+  // Ctrl-C in raw mode is just input, but a SIGINT from elsewhere is
+  // for the program too, with a terminal or without.
+  interrupt_forward(fdm);
 
-  // Save the defaults parameters
-  rc = tcgetattr(fd_termios, &old_termios);
-  if (rc == -1)
-    fatal("Error %d on tcgetattr()", errno);
+  // An explicit size stays, otherwise the pty follows the terminal.
+  if (size_cols != 0)
+    resize_set(fdm, size_cols, size_rows);
+  else if (fd_termios != -1)
+    resize_follow(fd_termios, fdm);
 
-  // Restore terminal on exit
-  atexit(cleanup);
-  siginterrupt (SIGINT, 1);
-  signal (SIGINT, handler);
+  // Headless, there's nothing else to set up.
+  if (fd_termios == -1)
+    return;
 
   if (fd_termios == 0)
     {
+      // Save the defaults parameters
+      rc = tcgetattr(0, &old_termios);
+      if (rc == -1)
+	fatal("Error %d on tcgetattr()", errno);
+
+      // Restore terminal on exit
+      atexit(cleanup);
+
       // Set RAW mode on stdin
       new_termios = old_termios;
       cfmakeraw (&new_termios);
@@ -118,34 +167,14 @@ static void terminal_settings(int fdm)
     }
 }
 
-static void master (int fdm)
-{
-  fd_set fd_in;
-
-  for (;;)
-    {
-      // Wait for data from standard input and master side of PTY
-      FD_ZERO(&fd_in);
-      FD_SET(0, &fd_in);
-      FD_SET(fdm, &fd_in);
-
-      if (select(fdm + 1, &fd_in, NULL, NULL, NULL) == -1)
-	fatal("Error %d on select()", errno);
-
-      // If data on standard input
-      if (FD_ISSET(0, &fd_in))
-	read_write("standard input", 0, fdm);
-
-      // If data on master side of PTY
-      if (FD_ISSET(fdm, &fd_in))
-	read_write("master pty", fdm, 1);
-    }
-}
-
-static void slave (int fds, char **av)
+#ifndef HAVE_SPAWN_SETSID
+static void slave (int fds, char **argv)
 {
   int rc;
 
+  // Statistics are for the relay, not the child.
+  config.stats = NULL;
+
   // The slave side of the PTY becomes the standard input and outputs
   // of the child process
   close(0); // Close standard input (current terminal)
@@ -176,40 +205,466 @@ static void slave (int fds, char **av)
   ioctl(0, TIOCSCTTY, 1);
 
   // Execution of the program
-  rc = execvp(av[1], av + 1);
+  rc = execvp(argv[0], argv);
   if (rc == -1)
     fatal("Error %d on execvp()", errno);
 
 }
+#endif
 
-int main(int ac, char *av[])
+#ifdef HAVE_SPAWN_SETSID
+// The same as slave, without copying the parent.  The program gets a
+// new session, and opening the slave side makes it the controlling
+// terminal.  The master side is close-on-exec.
+static pid_t spawn_slave (int fdm, int fds, char **argv)
+{
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  pid_t pid;
+  int rc;
+
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID);
+
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addclose(&actions, fds);
+  posix_spawn_file_actions_addopen(&actions, 0, ptsname(fdm), O_RDWR, 0);
+  posix_spawn_file_actions_adddup2(&actions, 0, 1);
+  posix_spawn_file_actions_adddup2(&actions, 0, 2);
+
+  rc = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+  if (rc != 0)
+    fatal("Error %d on posix_spawnp()", rc);
+
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  return pid;
+}
+#endif
+
+// Start a program on the slave side of the pty.  Returns its process
+// id.
+static pid_t start (int fdm, int fds, char **argv)
+{
+  pid_t pid;
+
+#ifdef HAVE_SPAWN_SETSID
+  pid = spawn_slave(fdm, fds, argv);
+#else
+  pid = fork();
+  if (pid == -1)
+    fatal("Error %d on fork()", errno);
+  if (pid == 0)
+    {
+      // Close the master side of the PTY
+      close(fdm);
+      slave(fds, argv);
+    }
+#endif
+
+  // Close the slave side of the PTY
+  close(fds);
+  return pid;
+}
+
+// Start a shell command on a pty of its own.  Returns the master side.
+static int spawn (char *command)
 {
+  char *argv[] = { "/bin/sh", "-c", command, NULL };
   int fdm, fds;
 
-  // Check arguments
-  if (ac <= 1)
-    fatal("Usage: %s program_name [parameters]", av[0]);
+  fdm = open_pty(&fds);
+  if (size_cols != 0)
+    resize_set(fdm, size_cols, size_rows);
+  start(fdm, fds, argv);
+  return fdm;
+}
 
-  fdm = open_master();
+static void multiplex (int n, char **commands)
+{
+  int i, *fdm;
 
-  terminal_settings(fdm);
+  fdm = malloc(n * sizeof *fdm);
+  if (fdm == NULL)
+    fatal("Out of memory");
 
-  // Open the slave side ot the PTY
-  fds = open(ptsname(fdm), O_RDWR);
+  for (i = 0; i < n; i++)
+    fdm[i] = spawn(commands[i]);
 
-  // Create the child process
-  if (fork())
+  mux_master(fdm, n);
+}
+
+static void usage (const char *name)
+{
+  fatal("Usage: %s [options] program_name [parameters]\n"
+	"       %s [options] -m command...\n"
+	"       %s --pool-server=SOCKET[,SIZE]\n"
+	"       %s --replay=FILE [--speed=FACTOR] [--start=SECONDS]\n"
+	"       %s --shm-cat=NAME\n"
+	"\n"
+	"  -b, --buffer-size=SIZE   relay buffer size per direction"
+	" (default 64K)\n"
+	"  -c, --coalesce=SIZE[,USEC]\n"
+	"                           batch output to a non-terminal up to"
+	" SIZE bytes,\n"
+	"                           holding it at most USEC (default 1000)\n"
+	"  -d, --drain[=COUNT]      non-blocking I/O, read until EAGAIN"
+	" up to COUNT\n"
+	"                           times per wakeup (default 16)\n"
+	"  -e, --engine=NAME        epoll, kqueue, poll, or uring"
+	" (default best available)\n"
+	"  -m, --multiplex          run each command on its own pty,"
+	" framing their\n"
+	"                           input and output as \"ID LENGTH\\n\""
+	" and data\n"
+	"  -s, --splice             move pty output to standard output"
+	" with splice()\n"
+	"  -t, --timestamps         start each output line with the time"
+	" it was read\n"
+	"  -x, --expect=FILE        answer output matching the triggers in"
+	" FILE\n"
+	"      --compress=NAME      compress output and decompress input"
+	" with lz4 or zstd\n"
+	"      --connect=ADDRESS    relay over a connection to ADDRESS,"
+	" HOST:PORT or a\n"
+	"                           Unix socket path, reconnecting when"
+	" it's lost\n"
+	"      --interrupt          pass the interrupt character to the"
+	" program ahead of\n"
+	"                           input it hasn't read\n"
+	"      --filter=LIST        remove escape sequences from output:"
+	" sgr, csi,\n"
+	"                           osc, esc, or all\n"
+	"      --listen=ADDRESS     relay over connections to ADDRESS, one"
+	" at a time\n"
+	"      --max-rate=RATE[,BURST]\n"
+	"                           read output at most RATE bytes a second,"
+	" BURST at a\n"
+	"                           time (default a tenth of RATE)\n"
+	"      --quantum=SIZE       write at most SIZE bytes of output"
+	" between looks at\n"
+	"                           input\n"
+	"      --scrollback=SIZE    output a new connection gets first"
+	" (default 64K)\n"
+	"      --screen=FILE        append the screen's changed rows to FILE"
+	" as JSON on\n"
+	"                           SIGUSR1 and at exit\n"
+	"      --size=COLSxROWS     give the pty this size instead of the"
+	" terminal's\n"
+	"      --shm=NAME           put output in the shared memory ring"
+	" NAME\n"
+	"      --shm-cat=NAME       copy the shared memory ring NAME to"
+	" standard output\n"
+	"      --strip-ansi         the same as --filter=all\n"
+	"      --threads            relay with a thread for each direction"
+	" instead of an\n"
+	"                           event loop\n"
+	"      --buffer-pool=SIZE   with --threads only, memory for its"
+	" buffer pool\n"
+	"                           (default 16 buffers)\n"
+	"      --tag=TAG            start each output line with TAG\n"
+	"      --tail=FILE[,SIZE]   keep the last SIZE bytes of output"
+	" (default 1M) in\n"
+	"                           memory, and write them to FILE on"
+	" SIGUSR2 and on\n"
+	"                           failure\n"
+	"      --stats=FILE         append relay statistics to FILE as JSON"
+	" on SIGUSR1\n"
+	"                           and at exit\n"
+	"      --pool=SOCKET        get the pty from a pool server,"
+	" if one is running\n"
+	"      --pool-server=SOCKET[,SIZE]\n"
+	"                           keep SIZE ptys open (default 8) and"
+	" hand them out\n"
+	"                           on SOCKET\n"
+	"      --record=FILE        record output with timestamps to FILE\n"
+	"      --replay=FILE        play a recording on standard output\n"
+	"      --speed=FACTOR       replay FACTOR times as fast, 0 for"
+	" no delays (default 1)\n"
+	"      --start=SECONDS      replay from SECONDS into the recording",
+	name, name, name, name, name);
+}
+
+// Parse a size with an optional K, M, or G suffix.
+static size_t parse_size (const char *name, const char *arg)
+{
+  unsigned long long size;
+  char *end;
+
+  errno = 0;
+  size = strtoull(arg, &end, 10);
+  switch (*end)
     {
-      // Close the slave side of the PTY
-      close(fds);
-      master(fdm);
+    case 'k': case 'K': size <<= 10; end++; break;
+    case 'm': case 'M': size <<= 20; end++; break;
+    case 'g': case 'G': size <<= 30; end++; break;
     }
-  else
+  if (errno != 0 || end == arg || *end != 0 || size == 0)
+    fatal("Invalid %s: %s", name, arg);
+
+  return size;
+}
+
+// Parse a non-negative number, which may have a fraction.
+static double parse_number (const char *name, const char *arg)
+{
+  double number;
+  char *end;
+
+  errno = 0;
+  number = strtod(arg, &end);
+  if (errno != 0 || end == arg || *end != 0 || number < 0)
+    fatal("Invalid %s: %s", name, arg);
+
+  return number;
+}
+
+static const struct option long_options[] =
+{
+  { "buffer-size", required_argument, NULL, 'b' },
+  { "buffer-pool", required_argument, NULL, 'U' },
+  { "coalesce", required_argument, NULL, 'c' },
+  { "compress", required_argument, NULL, 'C' },
+  { "connect", required_argument, NULL, 'N' },
+  { "drain", optional_argument, NULL, 'd' },
+  { "engine", required_argument, NULL, 'e' },
+  { "expect", required_argument, NULL, 'x' },
+  { "filter", required_argument, NULL, 'F' },
+  { "interrupt", no_argument, NULL, 'I' },
+  { "listen", required_argument, NULL, 'L' },
+  { "max-rate", required_argument, NULL, 'M' },
+  { "multiplex", no_argument, NULL, 'm' },
+  { "splice", no_argument, NULL, 's' },
+  { "stats", required_argument, NULL, 'S' },
+  { "strip-ansi", no_argument, NULL, 'A' },
+  { "tag", required_argument, NULL, 'g' },
+  { "tail", required_argument, NULL, 'O' },
+  { "threads", no_argument, NULL, 'j' },
+  { "timestamps", no_argument, NULL, 't' },
+  { "pool", required_argument, NULL, 'P' },
+  { "quantum", required_argument, NULL, 'Y' },
+  { "pool-server", required_argument, NULL, 'Q' },
+  { "record", required_argument, NULL, 'R' },
+  { "replay", required_argument, NULL, 'r' },
+  { "speed", required_argument, NULL, 'V' },
+  { "scrollback", required_argument, NULL, 'B' },
+  { "screen", required_argument, NULL, 'W' },
+  { "shm", required_argument, NULL, 'H' },
+  { "size", required_argument, NULL, 'Z' },
+  { "shm-cat", required_argument, NULL, 'K' },
+  { "start", required_argument, NULL, 'T' },
+  { NULL, 0, NULL, 0 }
+};
+
+int main(int ac, char *av[])
+{
+  char *coalesce = NULL, *server = NULL, *replay_file = NULL, *p;
+  char *listen_address = NULL, *connect_address = NULL;
+  char *shm_cat_name = NULL, *max_rate = NULL;
+  double speed = 1, start_time = 0;
+  int pool_size = 8;
+  size_t scrollback = 65536, rate, burst = 0;
+  int fdm, fds, c;
+  char extra;
+
+  // Check arguments.  Stop at the first non-option, the rest belongs
+  // to the program.
+  while ((c = getopt_long(ac, av, "+b:c:d::e:mstx:", long_options, NULL)) != -1)
     {
-      // Close the master side of the PTY
-      close(fdm);
-      slave(fds, av);
+      switch (c)
+	{
+	case 'b':
+	  config.buffer_size = parse_size("buffer size", optarg);
+	  break;
+	case 'c':
+	  coalesce = optarg;
+	  break;
+	case 'C':
+	  compress_init(optarg);
+	  break;
+	case 'L':
+	  listen_address = optarg;
+	  break;
+	case 'N':
+	  connect_address = optarg;
+	  break;
+	case 'B':
+	  scrollback = parse_size("scrollback size", optarg);
+	  break;
+	case 'H':
+	  config.shm = optarg;
+	  break;
+	case 'I':
+	  config.interrupt = 1;
+	  break;
+	case 'Y':
+	  config.quantum = parse_size("quantum", optarg);
+	  break;
+	case 'M':
+	  max_rate = optarg;
+	  break;
+	case 'O':
+	  config.tail = optarg;
+	  break;
+	case 'W':
+	  config.screen = optarg;
+	  break;
+	case 'Z':
+	  if (sscanf(optarg, "%dx%d%c", &size_cols, &size_rows, &extra) != 2
+	      || size_cols <= 0 || size_rows <= 0
+	      || size_cols > 65535 || size_rows > 65535)
+	    fatal("Invalid size: %s", optarg);
+	  break;
+	case 'K':
+	  shm_cat_name = optarg;
+	  break;
+	case 'd':
+	  config.drain = optarg ? parse_size("drain count", optarg) : 16;
+	  break;
+	case 'e':
+	  config.engine = optarg;
+	  break;
+	case 'm':
+	  config.multiplex = 1;
+	  break;
+	case 's':
+	  config.splice = 1;
+	  break;
+	case 't':
+	  config.timestamps = 1;
+	  break;
+	case 'g':
+	  config.tag = optarg;
+	  break;
+	case 'j':
+	  config.threads = 1;
+	  break;
+	case 'U':
+	  config.buffer_pool = parse_size("buffer pool size", optarg);
+	  break;
+	case 'S':
+	  config.stats = optarg;
+	  break;
+	case 'P':
+	  config.pool = optarg;
+	  break;
+	case 'Q':
+	  server = optarg;
+	  break;
+	case 'R':
+	  config.record = optarg;
+	  break;
+	case 'r':
+	  replay_file = optarg;
+	  break;
+	case 'x':
+	  config.expect = optarg;
+	  break;
+	case 'A':
+	  config.filter |= filter_parse("all");
+	  break;
+	case 'F':
+	  config.filter |= filter_parse(optarg);
+	  break;
+	case 'V':
+	  speed = parse_number("speed", optarg);
+	  break;
+	case 'T':
+	  start_time = parse_number("start time", optarg);
+	  break;
+	default:
+	  usage(av[0]);
+	}
+    }
+
+  if (replay_file != NULL)
+    replay(replay_file, speed, start_time * 1e6);
+  if (shm_cat_name != NULL)
+    shm_cat(shm_cat_name);
+
+  if (server != NULL)
+    {
+      p = strchr(server, ',');
+      if (p != NULL)
+	{
+	  *p++ = 0;
+	  pool_size = parse_size("pool size", p);
+	}
+      config.pool = NULL;
+      pool_server(server, pool_size);
+    }
+
+  // Output goes to one place.
+  if (optind >= ac || (listen_address != NULL && connect_address != NULL)
+      || (config.shm != NULL
+	  && (listen_address || connect_address || config.multiplex)))
+    usage(av[0]);
+
+  // The event loop has a ring per direction, the pool is for threads.
+  if (config.buffer_pool && !config.threads)
+    fatal("--buffer-pool only applies with --threads");
+
+  if (coalesce != NULL)
+    {
+      p = strchr(coalesce, ',');
+      if (p != NULL)
+	{
+	  *p++ = 0;
+	  config.coalesce_usec = parse_size("coalesce time", p);
+	}
+      config.coalesce = parse_size("coalesce size", coalesce);
+      if (config.coalesce > config.buffer_size)
+	config.coalesce = config.buffer_size;
+    }
+
+  if (max_rate != NULL)
+    {
+      p = strchr(max_rate, ',');
+      if (p != NULL)
+	{
+	  *p++ = 0;
+	  burst = parse_size("burst size", p);
+	}
+      rate = parse_size("rate", max_rate);
+      if (burst == 0)
+	burst = rate >= 10 ? rate / 10 : 1;
+      rate_init(rate, burst);
+    }
+
+  if (config.tail != NULL)
+    {
+      config.tail_size = 1 << 20;
+      p = strchr(config.tail, ',');
+      if (p != NULL)
+	{
+	  *p++ = 0;
+	  config.tail_size = parse_size("tail size", p);
+	}
     }
 
+  // Before starting the child, which may signal right away.
+  stats_init();
+
+  if (listen_address != NULL)
+    net_init(listen_address, 1, scrollback);
+  if (connect_address != NULL)
+    net_init(connect_address, 0, scrollback);
+
+  if (config.multiplex)
+    multiplex(ac - optind, av + optind);
+
+  // Open both sides of the PTY.  Holding the slave side open until
+  // the child has it keeps the master side from reporting a hangup.
+  fdm = open_pty(&fds);
+
+  // The terminal, if any, isn't where the program's input and output
+  // go with a socket.
+  if (!net_active())
+    terminal_settings(fdm);
+
+  // Create the child process
+  child_watch(start(fdm, fds, av + optind));
+  master(fdm);
+
   return 0;
 } // main
@@ -0,0 +1,289 @@
+/*
+ * Relay for several programs at once, each on its own pty.
+ *
+ * Output from program number ID, counting from 0, is framed on
+ * standard output as a header line "ID LENGTH" followed by LENGTH
+ * bytes.  A frame with LENGTH 0 says the program has closed its pty.
+ * Standard input takes the same frames, and passes each to the
+ * program it names.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "pty-stdio.h"
+#include "relay.h"
+#include "event.h"
+#include "record.h"
+
+// Longest frame header.
+#define HEADER_MAX 32
+
+struct child
+{
+  int id;
+  int fdm;
+  struct direction input;  // Framed input on its way to the pty.
+  int eof;
+};
+
+static struct event_engine *engine;
+static struct direction input, output;
+static char *scratch;
+static int paused;  // Standard output has no room for another frame.
+
+// The frame on standard input being taken apart.
+static char header[HEADER_MAX];
+static size_t header_length;
+static struct child *target;
+static size_t remaining;
+
+static void child_update (struct child *c)
+{
+  int events = 0;
+
+  if (!c->eof && !paused)
+    events |= EVENT_READ;
+  if (!c->input.writable && !ring_empty(&c->input.ring))
+    events |= EVENT_WRITE;
+
+  event_modify(engine, c->fdm, events, c);
+}
+
+static void put_frame (int id, const char *data, size_t n)
+{
+  char buffer[HEADER_MAX];
+  int length;
+
+  length = snprintf(buffer, sizeof buffer, "%d %zu\n", id, n);
+  ring_put(&output.ring, buffer, length);
+  ring_put(&output.ring, data, n);
+  record_data(buffer, length);
+  record_data(data, n);
+}
+
+static int child_read (struct child *c)
+{
+  size_t n = ring_room(&output.ring) - HEADER_MAX;
+  ssize_t rc;
+
+  if (n > config.buffer_size)
+    n = config.buffer_size;
+
+  output.count->reads++;
+  rc = read(c->fdm, scratch, n);
+  if (rc < 0)
+    {
+      if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+	return 0;
+      // The master side reports EIO when the child is gone.
+      if (errno != EIO)
+	fatal("Error %d on read master pty %d", errno, c->id);
+      rc = 0;
+    }
+
+  put_frame(c->id, scratch, rc);
+  stats_buffered(output.count, ring_used(&output.ring));
+  if (rc == 0)
+    {
+      c->eof = 1;
+      return 1;
+    }
+
+  return 0;
+}
+
+static void parse_header (struct child *children, int n)
+{
+  unsigned long id;
+  unsigned long long length = 0;
+  char *end;
+
+  header[header_length] = 0;
+  errno = 0;
+  id = strtoul(header, &end, 10);
+  if (end != header && *end == ' ')
+    length = strtoull(end + 1, &end, 10);
+  if (errno != 0 || end == header || *end != 0 || id >= (unsigned long)n)
+    fatal("Invalid frame header on standard input: %s", header);
+
+  target = &children[id];
+  remaining = length;
+  header_length = 0;
+}
+
+// Pass framed standard input on to the programs.  Stop when a program
+// can't take more.
+static void dispatch (struct child *children, int n)
+{
+  size_t length;
+  char *data;
+
+  while (!ring_empty(&input.ring))
+    {
+      data = ring_pending(&input.ring, &length);
+
+      if (remaining == 0)
+	{
+	  ring_consume(&input.ring, 1);
+	  if (*data == '\n')
+	    parse_header(children, n);
+	  else if (header_length == HEADER_MAX - 1)
+	    fatal("Invalid frame header on standard input");
+	  else
+	    header[header_length++] = *data;
+	  continue;
+	}
+
+      if (length > remaining)
+	length = remaining;
+
+      // Input for a program that's gone is dropped.
+      if (!target->eof)
+	{
+	  if (length > ring_room(&target->input.ring))
+	    length = ring_room(&target->input.ring);
+	  if (length == 0)
+	    break;
+	  ring_put(&target->input.ring, data, length);
+	  direction_flush(&target->input);
+	  child_update(target);
+	}
+
+      ring_consume(&input.ring, length);
+      remaining -= length;
+    }
+}
+
+static void read_input (void)
+{
+  size_t n;
+  char *space;
+  ssize_t rc;
+
+  space = ring_space(&input.ring, &n);
+  input.count->reads++;
+  rc = read(0, space, n);
+  if (rc < 0)
+    {
+      if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+	return;
+      fatal("Error %d on read standard input", errno);
+    }
+
+  if (rc == 0)
+    input.eof = 1;
+  ring_produce(&input.ring, rc);
+  stats_buffered(input.count, ring_used(&input.ring));
+}
+
+void mux_master (int *fdm, int n)
+{
+  struct child *children;
+  struct event ev[64];
+  int i, k, live = n;
+
+  children = calloc(n, sizeof *children);
+  scratch = malloc(config.buffer_size);
+  if (children == NULL || scratch == NULL)
+    fatal("Out of memory");
+
+  // Output is recorded as it's labelled, not through the stages.
+  if (config.record != NULL)
+    record_open(config.record);
+
+  direction_init(&input, "standard input", 0, NULL, -1);
+  direction_init(&output, NULL, -1, "standard output", 1);
+  set_nonblock(1);
+
+  if (config.engine != NULL && strcmp(config.engine, "uring") == 0)
+    config.engine = NULL;
+  engine = event_open(config.engine);
+  stats.engine = event_name(engine);
+  event_add(engine, 0, EVENT_READ, NULL);
+  event_add(engine, 1, 0, NULL);
+
+  for (i = 0; i < n; i++)
+    {
+      struct child *c = &children[i];
+
+      c->id = i;
+      c->fdm = fdm[i];
+      direction_init(&c->input, "standard input", 0, "master pty", fdm[i]);
+      set_nonblock(c->fdm);
+      event_add(engine, c->fdm, EVENT_READ, c);
+    }
+
+  for (;;)
+    {
+      stats_check();
+
+      // Stop reading from the ptys while a frame might not fit on
+      // standard output.
+      if (paused != (ring_room(&output.ring) <= HEADER_MAX))
+	{
+	  paused = !paused;
+	  for (i = 0; i < n; i++)
+	    if (!children[i].eof)
+	      child_update(&children[i]);
+	}
+
+      event_modify(engine, 0, !input.eof && !ring_full(&input.ring)
+		   ? EVENT_READ : 0, NULL);
+      event_modify(engine, 1, !output.writable && !ring_empty(&output.ring)
+		   ? EVENT_WRITE : 0, NULL);
+
+      k = event_wait(engine, ev, 64, -1);
+      stats.wakeups++;
+      if (k == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  fatal("Error %d on %s wait", errno, event_name(engine));
+	}
+
+      for (i = 0; i < k; i++)
+	{
+	  struct child *c = ev[i].data;
+
+	  if (c == NULL)
+	    {
+	      if (ev[i].fd == 0)
+		read_input();
+	      else
+		output.writable = 1;
+	      continue;
+	    }
+
+	  if (c->eof)
+	    continue;
+
+	  if (ev[i].events & EVENT_WRITE)
+	    {
+	      c->input.writable = 1;
+	      direction_flush(&c->input);
+	    }
+
+	  if ((ev[i].events & EVENT_READ) && !c->eof
+	      && ring_room(&output.ring) > HEADER_MAX && child_read(c))
+	    {
+	      // Done with this one.
+	      event_remove(engine, c->fdm);
+	      close(c->fdm);
+	      live--;
+	      continue;
+	    }
+
+	  child_update(c);
+	}
+
+      dispatch(children, n);
+      direction_flush(&output);
+
+      // All programs are gone.  Exit when their output is written.
+      if (live == 0 && ring_empty(&output.ring))
+	exit(0);
+    }
+}
@@ -0,0 +1,306 @@
+/*
+ * Socket transport.  The connection goes on standard input and output,
+ * so the relay works on it as it would on a pipe.  Between connections
+ * they are /dev/null, and the relay goes on reading the program's
+ * output into the scrollback, which the next connection gets first.
+ *
+ * One connection is served at a time.  A client connecting to a
+ * listening pty-stdio waits for the previous one to go.  When
+ * connecting, a lost or refused connection is tried again every
+ * second.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "pty-stdio.h"
+#include "net.h"
+#include "compress.h"
+
+#define RETRY_USEC 1000000
+
+static struct sockaddr_storage address;
+static socklen_t address_length;
+static int listening;
+static int fd = -1;            // Listening or connecting socket.
+static long long retry_at;
+
+static char *scrollback;
+static size_t size;
+static unsigned long long saved;  // Total output saved.
+
+static void resolve (const char *spec)
+{
+  struct sockaddr_un *sun = (struct sockaddr_un *)&address;
+  struct addrinfo hints, *ai;
+  char *host, *port;
+  size_t n;
+  int rc;
+
+  if (strchr(spec, '/') != NULL)
+    {
+      if (strlen(spec) >= sizeof sun->sun_path)
+	fatal("Socket path too long: %s", spec);
+      sun->sun_family = AF_UNIX;
+      strcpy(sun->sun_path, spec);
+      address_length = sizeof *sun;
+      return;
+    }
+
+  host = strdup(spec);
+  if (host == NULL)
+    fatal("Out of memory");
+  port = strrchr(host, ':');
+  if (port == NULL)
+    fatal("Invalid address: %s", spec);
+  *port++ = 0;
+
+  // An IPv6 address in brackets.
+  n = strlen(host);
+  if (n >= 2 && host[0] == '[' && host[n - 1] == ']')
+    {
+      host[n - 1] = 0;
+      host++;
+    }
+
+  memset(&hints, 0, sizeof hints);
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = listening ? AI_PASSIVE : 0;
+  rc = getaddrinfo(*host ? host : NULL, port, &hints, &ai);
+  if (rc != 0)
+    fatal("Can't resolve %s: %s", spec, gai_strerror(rc));
+
+  memcpy(&address, ai->ai_addr, ai->ai_addrlen);
+  address_length = ai->ai_addrlen;
+  freeaddrinfo(ai);
+}
+
+void net_init (const char *spec, int listen, size_t scrollback_size)
+{
+  listening = listen;
+  resolve(spec);
+
+  size = scrollback_size;
+  scrollback = malloc(size);
+  if (scrollback == NULL)
+    fatal("Out of memory");
+}
+
+int net_active (void)
+{
+  return address_length != 0;
+}
+
+// Standard input and output to /dev/null.
+static void quiet (void)
+{
+  int null;
+
+  null = open("/dev/null", O_RDWR);
+  if (null == -1)
+    fatal("Error %d on open /dev/null", errno);
+  dup2(null, 0);
+  dup2(null, 1);
+  if (null > 1)
+    close(null);
+}
+
+// The connection is up, put it on standard input and output.
+static int up (int s)
+{
+  int one = 1;
+
+  // Keystrokes go out at once.  Bulk output leaves in big writes
+  // anyway.
+  if (address.ss_family != AF_UNIX)
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+  dup2(s, 0);
+  dup2(s, 1);
+  close(s);
+  return 1;
+}
+
+static void retry (void)
+{
+  close(fd);
+  fd = -1;
+  retry_at = monotonic_usec() + RETRY_USEC;
+}
+
+static int attempt (struct event_engine *engine)
+{
+  int s;
+
+  fd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	      0);
+  if (fd == -1)
+    fatal("Error %d on socket()", errno);
+
+  if (connect(fd, (struct sockaddr *)&address, address_length) == 0)
+    {
+      s = fd;
+      fd = -1;
+      return up(s);
+    }
+
+  if (errno == EINPROGRESS)
+    event_add(engine, fd, EVENT_WRITE, NULL);
+  else
+    retry();
+  return 0;
+}
+
+int net_start (struct event_engine *engine)
+{
+  const struct sockaddr_un *sun = (const struct sockaddr_un *)&address;
+  int one = 1;
+
+  // A write to a closed connection fails with EPIPE instead.
+  signal(SIGPIPE, SIG_IGN);
+  quiet();
+
+  if (!listening)
+    return attempt(engine);
+
+  fd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	      0);
+  if (fd == -1)
+    fatal("Error %d on socket()", errno);
+  if (address.ss_family == AF_UNIX)
+    unlink(sun->sun_path);
+  else
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+  if (bind(fd, (struct sockaddr *)&address, address_length) == -1)
+    fatal("Error %d on bind()", errno);
+  if (listen(fd, 1) == -1)
+    fatal("Error %d on listen()", errno);
+
+  event_add(engine, fd, EVENT_READ, NULL);
+  return 0;
+}
+
+int net_event (struct event_engine *engine, const struct event *ev)
+{
+  socklen_t length = sizeof (int);
+  int s, error = 0;
+
+  if (fd == -1 || ev->fd != fd)
+    return 0;
+
+  if (listening)
+    {
+      s = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (s == -1)
+	return 0;
+      event_modify(engine, fd, 0, NULL);
+      return up(s);
+    }
+
+  // The connect is done, one way or the other.
+  event_remove(engine, fd);
+  getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+  if (error != 0)
+    {
+      retry();
+      return 0;
+    }
+
+  s = fd;
+  fd = -1;
+  return up(s);
+}
+
+int net_check (struct event_engine *engine)
+{
+  if (listening || fd != -1 || monotonic_usec() < retry_at)
+    return 0;
+  return attempt(engine);
+}
+
+long net_timeout (void)
+{
+  long long left;
+
+  if (listening || fd != -1)
+    return -1;
+
+  left = retry_at - monotonic_usec();
+  return left > 0 ? left : 0;
+}
+
+void net_lost (struct event_engine *engine)
+{
+  quiet();
+  if (listening)
+    event_modify(engine, fd, EVENT_READ, NULL);
+  else
+    retry_at = monotonic_usec();
+}
+
+void net_save (const char *data, size_t n)
+{
+  size_t offset, length;
+
+  if (size == 0)
+    return;
+
+  if (n > size)
+    {
+      saved += n - size;
+      data += n - size;
+      n = size;
+    }
+
+  while (n > 0)
+    {
+      offset = saved % size;
+      length = size - offset < n ? size - offset : n;
+      memcpy(scrollback + offset, data, length);
+      saved += length;
+      data += length;
+      n -= length;
+    }
+}
+
+static void put (struct ring *r, const char *data, size_t n)
+{
+  if (compress_active())
+    compress_put(r, data, n);
+  else
+    ring_put(r, data, n);
+}
+
+void net_resume (struct ring *r)
+{
+  size_t n = saved < size ? saved : size, offset, length;
+
+  if (compress_active())
+    compress_reset();
+
+  if (n > 0)
+    {
+      // Oldest first.
+      offset = (saved - n) % size;
+      length = size - offset < n ? size - offset : n;
+      put(r, scrollback + offset, length);
+      put(r, scrollback, n - length);
+    }
+
+  if (compress_active())
+    compress_flush(r);
+}
+
+size_t net_scrollback (void)
+{
+  return size;
+}
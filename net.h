@@ -0,0 +1,37 @@
+/*
+ * Relay over a socket instead of standard input and output.
+ */
+
+#ifndef NET_H
+#define NET_H
+
+#include <stddef.h>
+#include "ring.h"
+#include "event.h"
+
+// ADDRESS is HOST:PORT, :PORT for any local address when listening,
+// or a Unix domain socket path with a slash in it.  Output is kept in
+// a scrollback of the given size for clients that connect later.
+extern void net_init (const char *address, int listen, size_t scrollback);
+extern int net_active (void);
+
+// Start waiting for a connection, or connecting.  Returns 1 once it's
+// up on standard input and output, as can net_event and net_check.
+extern int net_start (struct event_engine *);
+extern int net_event (struct event_engine *, const struct event *);
+extern int net_check (struct event_engine *);
+
+// Microseconds until the next attempt to connect, or -1.
+extern long net_timeout (void);
+
+// The connection is gone.  Standard input and output are /dev/null
+// until the next one.
+extern void net_lost (struct event_engine *);
+
+// Keep output for the next connection, and put the scrollback in the
+// ring for it.  With compression, it starts a new stream.
+extern void net_save (const char *data, size_t n);
+extern void net_resume (struct ring *);
+extern size_t net_scrollback (void);
+
+#endif
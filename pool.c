@@ -0,0 +1,173 @@
+/*
+ * Pty pool.  The server opens pty pairs ahead of time, so a client
+ * gets one with a single connect instead of posix_openpt, grantpt,
+ * unlockpt, and open.  Each connection receives one pair as two file
+ * descriptors in an SCM_RIGHTS message, and the server replaces it
+ * while waiting for the next.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "pty-stdio.h"
+#include "relay.h"
+#include "event.h"
+#include "pool.h"
+
+struct pair
+{
+  int fdm, fds;
+};
+
+static void address (struct sockaddr_un *sun, const char *path)
+{
+  if (strlen(path) >= sizeof sun->sun_path)
+    fatal("Socket path too long: %s", path);
+
+  memset(sun, 0, sizeof *sun);
+  sun->sun_family = AF_UNIX;
+  strcpy(sun->sun_path, path);
+}
+
+static void send_pair (int fd, struct pair *p)
+{
+  union
+  {
+    struct cmsghdr align;
+    char buffer[CMSG_SPACE(2 * sizeof (int))];
+  } control;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec iov;
+  char byte = 0;
+  int fds[2] = { p->fdm, p->fds };
+
+  memset(&msg, 0, sizeof msg);
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = sizeof control.buffer;
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof fds);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof fds);
+
+  // A client that's gone just doesn't get it.
+  sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+void pool_server (const char *path, int size)
+{
+  struct event_engine *engine;
+  struct sockaddr_un sun;
+  struct pair *pairs;
+  struct event ev;
+  int s, c, n = 0;
+
+  pairs = calloc(size, sizeof *pairs);
+  if (pairs == NULL)
+    fatal("Out of memory");
+
+  address(&sun, path);
+  s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (s == -1)
+    fatal("Error %d on socket()", errno);
+  unlink(path);
+  if (bind(s, (struct sockaddr *)&sun, sizeof sun) == -1)
+    fatal("Error %d on bind %s", errno, path);
+  if (listen(s, 128) == -1)
+    fatal("Error %d on listen()", errno);
+  set_nonblock(s);
+
+  engine = event_open(config.engine);
+  event_add(engine, s, EVENT_READ, NULL);
+
+  for (;;)
+    {
+      // Top up the pool between connections, but serve them first.
+      if (event_wait(engine, &ev, 1, n < size ? 0 : -1) <= 0)
+	{
+	  if (n < size)
+	    {
+	      pairs[n].fdm = open_pty(&pairs[n].fds);
+	      n++;
+	    }
+	  continue;
+	}
+
+      c = accept4(s, NULL, NULL, SOCK_CLOEXEC);
+      if (c == -1)
+	continue;
+
+      if (n == 0)
+	{
+	  pairs[0].fdm = open_pty(&pairs[0].fds);
+	  n++;
+	}
+      n--;
+      send_pair(c, &pairs[n]);
+      close(pairs[n].fdm);
+      close(pairs[n].fds);
+      close(c);
+    }
+}
+
+int pool_get (const char *path, int *fds)
+{
+  union
+  {
+    struct cmsghdr align;
+    char buffer[CMSG_SPACE(2 * sizeof (int))];
+  } control;
+  struct sockaddr_un sun;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec iov;
+  char byte;
+  int s, pair[2];
+
+  address(&sun, path);
+  s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (s == -1)
+    return -1;
+  if (connect(s, (struct sockaddr *)&sun, sizeof sun) == -1)
+    {
+      close(s);
+      return -1;
+    }
+
+  memset(&msg, 0, sizeof msg);
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = sizeof control.buffer;
+
+  if (recvmsg(s, &msg, 0) != 1)
+    {
+      close(s);
+      return -1;
+    }
+  close(s);
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET
+      || cmsg->cmsg_type != SCM_RIGHTS
+      || cmsg->cmsg_len != CMSG_LEN(sizeof pair))
+    return -1;
+
+  memcpy(pair, CMSG_DATA(cmsg), sizeof pair);
+  fcntl(pair[0], F_SETFD, FD_CLOEXEC);
+  *fds = pair[1];
+  return pair[0];
+}
@@ -0,0 +1,17 @@
+/*
+ * Pool of pty pairs opened ahead of time by a server process, and
+ * handed to clients over a Unix domain socket.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+// Serve pty pairs on the socket at path, keeping size of them ready.
+// Never returns.
+extern void pool_server (const char *path, int size);
+
+// Get a pty pair from the server.  Returns the master side and puts
+// the slave side in *fds, or returns -1 if there's no server.
+extern int pool_get (const char *path, int *fds);
+
+#endif
@@ -0,0 +1,549 @@
+/*
+ * Benchmark driver for pty-stdio.
+ *
+ * Usage: pty-bench [-S] [-n BYTES] [-l COUNT] pty-stdio [options]
+ *
+ * Pushes BYTES through pty-stdio in each direction, for several chunk
+ * sizes, and reports throughput and the number of system calls the
+ * relay makes per megabyte.  Then times COUNT single keystrokes echoed
+ * back by the program on the pty, and COUNT starts of pty-stdio with a
+ * program that exits at once.
+ *
+ * With -S, only the cost of starting: the time from exec of pty-stdio
+ * to the program it runs starting, next to the same for the program
+ * alone, and the peak resident size of pty-stdio, not counting the
+ * program.
+ *
+ * The programs on the pty are pty-bench itself, started with --source,
+ * --sink, --echo, or --stamp.
+ */
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sys/ptrace.h>
+#endif
+
+static const size_t chunks[] = { 64, 4096, 65536 };
+
+static char *self;
+static char **relay;
+static int relay_args;
+
+static void fatal (const char *message)
+{
+  perror(message);
+  exit(1);
+}
+
+static double now (void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void raw (void)
+{
+  struct termios t;
+
+  if (tcgetattr(0, &t) == -1)
+    fatal("tcgetattr");
+  cfmakeraw(&t);
+  if (tcsetattr(0, TCSANOW, &t) == -1)
+    fatal("tcsetattr");
+}
+
+static void write_all (int fd, const char *data, size_t n)
+{
+  ssize_t rc;
+
+  while (n > 0)
+    {
+      rc = write(fd, data, n);
+      if (rc < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  fatal("write");
+	}
+      data += rc;
+      n -= rc;
+    }
+}
+
+// Programs on the pty.
+
+static int source (size_t bytes, size_t chunk)
+{
+  char *buffer = malloc(chunk);
+  size_t n;
+
+  memset(buffer, 'x', chunk);
+  while (bytes > 0)
+    {
+      n = bytes < chunk ? bytes : chunk;
+      write_all(1, buffer, n);
+      bytes -= n;
+    }
+  return 0;
+}
+
+static int sink (size_t bytes)
+{
+  char buffer[65536];
+  ssize_t rc;
+
+  raw();
+  write_all(1, "R", 1);
+  while (bytes > 0)
+    {
+      rc = read(0, buffer, sizeof buffer);
+      if (rc <= 0)
+	return 1;
+      bytes -= rc;
+    }
+  return 0;
+}
+
+static int echo (void)
+{
+  char c;
+
+  raw();
+  write_all(1, "R", 1);
+  while (read(0, &c, 1) == 1 && c != 'q')
+    write_all(1, &c, 1);
+  return 0;
+}
+
+// Write the time to fd as soon as the program starts, then wait for
+// the other end to close it.
+static int stamp (int fd)
+{
+  double t = now();
+  ssize_t rc;
+  char c;
+
+  write_all(fd, (char *)&t, sizeof t);
+  do
+    rc = read(fd, &c, 1);
+  while (rc > 0 || (rc < 0 && errno == EINTR));
+  return 0;
+}
+
+// Driving pty-stdio.
+
+struct run
+{
+  pid_t pid;
+  int in, out;     // Its standard input and output.
+  int count;       // Tracer reports system calls here, or -1.
+  struct rusage usage;
+};
+
+#ifdef __linux__
+// Run the relay under ptrace and count its system calls.  Only the
+// relay itself is traced, not the program it starts.
+static void tracer (char **argv, int report)
+{
+  long calls = 0;
+  int status, entering = 1, sig = 0;
+  pid_t pid;
+
+  pid = fork();
+  if (pid == 0)
+    {
+      ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+      execv(argv[0], argv);
+      _exit(127);
+    }
+
+  // Stopped at exec.
+  if (waitpid(pid, &status, 0) == -1 || !WIFSTOPPED(status))
+    _exit(1);
+  ptrace(PTRACE_SETOPTIONS, pid, NULL,
+	 (void *)(PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL));
+
+  // Signals other than the system call stops are passed on.
+  while (ptrace(PTRACE_SYSCALL, pid, NULL, (void *)(long)sig) != -1)
+    {
+      if (waitpid(pid, &status, 0) == -1
+	  || WIFEXITED(status) || WIFSIGNALED(status))
+	break;
+      sig = WSTOPSIG(status);
+      if (sig == (SIGTRAP | 0x80))
+	{
+	  if (entering)
+	    calls++;
+	  entering = !entering;
+	  sig = 0;
+	}
+    }
+
+  write_all(report, (char *)&calls, sizeof calls);
+  _exit(0);
+}
+#endif
+
+// Start the program under pty-stdio, or on its own if direct.
+static void start (struct run *r, char **program, int trace, int direct)
+{
+  int in[2], out[2], count[2];
+  char **argv;
+  int i, n;
+
+  argv = calloc(relay_args + 5, sizeof *argv);
+  for (n = 0; n < relay_args && !direct; n++)
+    argv[n] = relay[n];
+  for (i = 0; program[i] != NULL; i++)
+    argv[n++] = program[i];
+
+  if (pipe(in) == -1 || pipe(out) == -1 || pipe(count) == -1)
+    fatal("pipe");
+
+  r->pid = fork();
+  if (r->pid == -1)
+    fatal("fork");
+  if (r->pid == 0)
+    {
+      dup2(in[0], 0);
+      dup2(out[1], 1);
+      close(in[0]); close(in[1]);
+      close(out[0]); close(out[1]);
+      close(count[0]);
+#ifdef __linux__
+      if (trace)
+	tracer(argv, count[1]);
+#endif
+      close(count[1]);
+      execv(argv[0], argv);
+      _exit(127);
+    }
+
+  close(in[0]);
+  close(out[1]);
+  close(count[1]);
+  r->in = in[1];
+  r->out = out[0];
+  r->count = trace ? count[0] : -1;
+  if (!trace)
+    close(count[0]);
+  free(argv);
+}
+
+// Read until the relay closes its output.  Returns the byte count.
+static size_t finish (struct run *r, long *calls)
+{
+  static char buffer[65536];
+  size_t total = 0;
+  ssize_t rc;
+
+  close(r->in);
+  while ((rc = read(r->out, buffer, sizeof buffer)) != 0)
+    {
+      if (rc < 0 && errno != EINTR)
+	fatal("read");
+      if (rc > 0)
+	total += rc;
+    }
+  close(r->out);
+
+  *calls = -1;
+  if (r->count != -1)
+    {
+      if (read(r->count, calls, sizeof *calls) != sizeof *calls)
+	*calls = -1;
+      close(r->count);
+    }
+
+  wait4(r->pid, NULL, 0, &r->usage);
+  return total;
+}
+
+static void wait_ready (struct run *r)
+{
+  char c;
+
+  if (read(r->out, &c, 1) != 1 || c != 'R')
+    {
+      fprintf(stderr, "No ready mark from the program\n");
+      exit(1);
+    }
+}
+
+// One throughput run.  Returns seconds, and system calls in *calls.
+static double output_run (size_t bytes, size_t chunk, int trace, long *calls)
+{
+  char b[32], c[32];
+  char *program[] = { self, "--source", b, c, NULL };
+  struct run r;
+  double t;
+  size_t n;
+
+  snprintf(b, sizeof b, "%zu", bytes);
+  snprintf(c, sizeof c, "%zu", chunk);
+  t = now();
+  start(&r, program, trace, 0);
+  n = finish(&r, calls);
+  t = now() - t;
+  if (n != bytes)
+    fprintf(stderr, "Got %zu bytes, expected %zu\n", n, bytes);
+  return t;
+}
+
+static double input_run (size_t bytes, size_t chunk, int trace, long *calls)
+{
+  char b[32];
+  char *program[] = { self, "--sink", b, NULL };
+  char *buffer = malloc(chunk);
+  struct run r;
+  double t;
+  size_t left, n;
+
+  memset(buffer, 'x', chunk);
+  snprintf(b, sizeof b, "%zu", bytes);
+  start(&r, program, trace, 0);
+  wait_ready(&r);
+
+  t = now();
+  for (left = bytes; left > 0; left -= n)
+    {
+      n = left < chunk ? left : chunk;
+      write_all(r.in, buffer, n);
+    }
+  finish(&r, calls);
+  t = now() - t;
+
+  free(buffer);
+  return t;
+}
+
+static void throughput (const char *name, size_t bytes,
+			double (*run) (size_t, size_t, int, long *))
+{
+  double mb = bytes / 1048576.0, t;
+  long calls;
+  size_t i;
+
+  for (i = 0; i < sizeof chunks / sizeof chunks[0]; i++)
+    {
+      t = run(bytes, chunks[i], 0, &calls);
+      printf("  %-6s  chunk %6zu  %9.1f MB/s", name, chunks[i], mb / t);
+
+      // Tracing is slow, so count system calls on a smaller run.
+      run(bytes / 8, chunks[i], 1, &calls);
+      if (calls >= 0)
+	printf("  %9.0f syscalls/MB\n", calls / (mb / 8));
+      else
+	printf("  %9s syscalls/MB\n", "n/a");
+      fflush(stdout);
+    }
+}
+
+static int compare (const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void latency (int count)
+{
+  char *program[] = { self, "--echo", NULL };
+  double *samples = malloc(count * sizeof *samples), t;
+  struct run r;
+  long calls;
+  int i;
+  char c;
+
+  start(&r, program, 0, 0);
+  wait_ready(&r);
+
+  for (i = 0; i < count; i++)
+    {
+      t = now();
+      write_all(r.in, "a", 1);
+      if (read(r.out, &c, 1) != 1)
+	fatal("read");
+      samples[i] = now() - t;
+    }
+  write_all(r.in, "q", 1);
+  finish(&r, &calls);
+
+  qsort(samples, count, sizeof *samples, compare);
+  printf("  echo    p50 %8.1f us  p99 %8.1f us\n",
+	 samples[count / 2] * 1e6, samples[count * 99 / 100] * 1e6);
+  free(samples);
+}
+
+// Time from starting pty-stdio to its exit, with a program that
+// exits right away.
+static void startup (int count)
+{
+  char *program[] = { self, "--source", "0", "1", NULL };
+  double *samples = malloc(count * sizeof *samples), t;
+  struct run r;
+  long calls;
+  int i;
+
+  for (i = 0; i < count; i++)
+    {
+      t = now();
+      start(&r, program, 0, 0);
+      finish(&r, &calls);
+      samples[i] = now() - t;
+    }
+
+  qsort(samples, count, sizeof *samples, compare);
+  printf("  startup p50 %8.1f us  p99 %8.1f us\n",
+	 samples[count / 2] * 1e6, samples[count * 99 / 100] * 1e6);
+  free(samples);
+}
+
+// The peak resident size in kilobytes of a running process, or -1.
+// Only its own: unlike ru_maxrss from wait4, this leaves out the
+// program pty-stdio started.
+static long peak_kb (pid_t pid)
+{
+  char name[64], line[256];
+  long kb = -1;
+  FILE *f;
+
+  snprintf(name, sizeof name, "/proc/%d/status", (int)pid);
+  f = fopen(name, "r");
+  if (f == NULL)
+    return -1;
+  while (fgets(line, sizeof line, f) != NULL)
+    if (sscanf(line, "VmHWM: %ld", &kb) == 1)
+      break;
+  fclose(f);
+  return kb;
+}
+
+// Seconds from exec to the program starting, and in *rss the peak
+// resident size in kilobytes of what was started, taken while the
+// program waits.  Without /proc, that of everything it started too.
+static double spawn_run (int direct, long *rss)
+{
+  char fd[16];
+  char *program[] = { self, "--stamp", fd, NULL };
+  struct run r;
+  int times[2];
+  long calls;
+  double t, started;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, times) == -1)
+    fatal("socketpair");
+  fcntl(times[0], F_SETFD, FD_CLOEXEC);
+  snprintf(fd, sizeof fd, "%d", times[1]);
+
+  t = now();
+  start(&r, program, 0, direct);
+  close(times[1]);
+  if (read(times[0], &started, sizeof started) != sizeof started)
+    fatal("read");
+  *rss = peak_kb(r.pid);
+  close(times[0]);
+  finish(&r, &calls);
+
+  if (*rss == -1)
+    *rss = r.usage.ru_maxrss;
+  return started - t;
+}
+
+static void spawn (int count)
+{
+  double *samples = malloc(count * sizeof *samples);
+  double *alone = malloc(count * sizeof *alone);
+  long rss, peak = 0, alone_peak = 0;
+  int i;
+
+  for (i = 0; i < count; i++)
+    {
+      samples[i] = spawn_run(0, &rss);
+      if (rss > peak)
+	peak = rss;
+      alone[i] = spawn_run(1, &rss);
+      if (rss > alone_peak)
+	alone_peak = rss;
+    }
+
+  qsort(samples, count, sizeof *samples, compare);
+  qsort(alone, count, sizeof *alone, compare);
+  printf("  exec    p50 %8.1f us  p99 %8.1f us  (program alone p50 %.1f us)\n",
+	 samples[count / 2] * 1e6, samples[count * 99 / 100] * 1e6,
+	 alone[count / 2] * 1e6);
+  printf("  rss     %ld KB peak  (program alone %ld KB)\n", peak, alone_peak);
+  free(samples);
+  free(alone);
+}
+
+int main (int argc, char **argv)
+{
+  size_t bytes = 64 << 20;
+  int count = 1000, only_start = 0, i;
+
+  if (argc >= 2 && strcmp(argv[1], "--source") == 0 && argc == 4)
+    return source(strtoull(argv[2], NULL, 10), strtoull(argv[3], NULL, 10));
+  if (argc >= 2 && strcmp(argv[1], "--sink") == 0 && argc == 3)
+    return sink(strtoull(argv[2], NULL, 10));
+  if (argc >= 2 && strcmp(argv[1], "--echo") == 0)
+    return echo();
+  if (argc >= 2 && strcmp(argv[1], "--stamp") == 0 && argc == 3)
+    return stamp(atoi(argv[2]));
+
+  self = argv[0];
+  for (i = 1; i < argc && argv[i][0] == '-'; i++)
+    {
+      if (strcmp(argv[i], "-S") == 0)
+	only_start = 1;
+      else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+	bytes = strtoull(argv[++i], NULL, 10);
+      else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+	count = atoi(argv[++i]);
+      else
+	break;
+    }
+  if (i >= argc || bytes == 0 || count <= 0)
+    {
+      fprintf(stderr,
+	      "Usage: %s [-S] [-n BYTES] [-l COUNT] pty-stdio [options]\n",
+	      argv[0]);
+      return 1;
+    }
+
+  relay = argv + i;
+  relay_args = argc - i;
+  signal(SIGPIPE, SIG_IGN);
+
+  printf("%s", relay[0]);
+  for (i = 1; i < relay_args; i++)
+    printf(" %s", relay[i]);
+  printf("\n");
+
+  if (only_start)
+    {
+      spawn(count);
+      return 0;
+    }
+
+  throughput("output", bytes, output_run);
+  throughput("input", bytes / 4, input_run);
+  latency(count);
+  startup(count);
+
+  return 0;
+}
@@ -0,0 +1,43 @@
+/*
+ * Declarations shared between the pty-stdio source files.
+ */
+
+#ifndef PTY_STDIO_H
+#define PTY_STDIO_H
+
+#include <stddef.h>
+
+// Settings from the command line.
+struct config
+{
+  size_t buffer_size;  // Per relay direction.
+  int drain;           // Reads per wakeup, 0 for one blocking read.
+  int splice;          // Move pty output with splice if possible.
+  const char *engine;  // NULL for the best available.
+  int multiplex;       // Run each argument as a shell command.
+  size_t coalesce;     // Batch pty output up to this many bytes,
+  long coalesce_usec;  // but hold it no longer than this.
+  const char *stats;   // File to write statistics to, or NULL.
+  const char *pool;    // Get ptys from the pool server at this socket.
+  const char *record;  // Record output to this file.
+  const char *expect;  // Triggers and responses in this file.
+  const char *shm;     // Publish output in this shared memory ring.
+  int threads;         // Relay with a thread per direction,
+  size_t buffer_pool;  // with this much for buffers.
+  size_t quantum;      // Most output to write between looks at input.
+  int interrupt;       // The interrupt character skips queued input.
+  const char *screen;  // Report the screen model to this file.
+  int filter;          // Escape sequences to remove, from filter_parse.
+  int timestamps;      // Start output lines with the time,
+  const char *tag;     // and this.
+  const char *tail;    // Write the last tail_size bytes of output here.
+  size_t tail_size;
+};
+
+extern struct config config;
+
+extern void fatal (const char *message, ...);
+extern long long monotonic_usec (void);
+extern int open_pty (int *fds);
+
+#endif
@@ -0,0 +1,75 @@
+/*
+ * Output rate limit.  The bucket fills at the rate, up to the burst,
+ * and each read from the pty takes what it got.  When it's empty the
+ * relay stops reading, so the pty fills up and the program blocks in
+ * write, and nothing is dropped or buffered without bound.
+ */
+
+#include "pty-stdio.h"
+#include "rate.h"
+#include "stats.h"
+
+// Wait for at least this much, rather than reading a few bytes at a
+// time.
+#define RATE_MIN_READ 4096
+
+static double rate, tokens, burst;
+static double least;  // Tokens worth a read.
+static long long last;
+
+void rate_init (double r, size_t b)
+{
+  rate = r;
+  burst = b;
+  least = burst < RATE_MIN_READ ? burst : RATE_MIN_READ;
+  tokens = burst;
+  last = monotonic_usec();
+}
+
+int rate_active (void)
+{
+  return rate > 0;
+}
+
+static void refill (void)
+{
+  long long now = monotonic_usec();
+
+  tokens += (now - last) * rate / 1e6;
+  if (tokens > burst)
+    tokens = burst;
+  last = now;
+}
+
+size_t rate_allow (void)
+{
+  struct counters *c = &stats.output;
+
+  refill();
+  if (tokens < least)
+    {
+      if (!c->throttled_since)
+	c->throttled_since = last;
+      return 0;
+    }
+
+  if (c->throttled_since)
+    {
+      c->throttled_usec += last - c->throttled_since;
+      c->throttled_since = 0;
+    }
+  return tokens;
+}
+
+void rate_take (size_t n)
+{
+  tokens -= n;
+}
+
+long rate_wait (void)
+{
+  refill();
+  if (tokens >= least)
+    return 0;
+  return (least - tokens) * 1e6 / rate + 1;
+}
@@ -0,0 +1,24 @@
+/*
+ * A token bucket limiting how fast output is read from the pty.
+ */
+
+#ifndef RATE_H
+#define RATE_H
+
+#include <stddef.h>
+
+// Read at most rate bytes a second, at most burst at a time.
+extern void rate_init (double rate, size_t burst);
+extern int rate_active (void);
+
+// How much may be read now.  0 while there are too few tokens to be
+// worth a read, which counts as throttled time.
+extern size_t rate_allow (void);
+
+// Take tokens for what was read.
+extern void rate_take (size_t n);
+
+// Microseconds until rate_allow will be more than 0.
+extern long rate_wait (void);
+
+#endif
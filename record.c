@@ -0,0 +1,253 @@
+/*
+ * Record pty output to a file without holding up the relay.  Records
+ * are encoded into a buffer on the spot, and a thread writes the
+ * buffer to the file.  If the thread falls behind and the buffer
+ * fills, output is dropped from the recording and the loss noted.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "pty-stdio.h"
+#include "ring.h"
+#include "record.h"
+
+#define BUFFER_SIZE (4 << 20)
+
+// Add a seek index entry after this much output or this much time.
+#define INDEX_BYTES (64 << 10)
+#define INDEX_USEC 1000000
+// Entries per index record.
+#define INDEX_ENTRIES 64
+
+// Longest record header: a type byte and two numbers.
+#define RECORD_HEADER_MAX (1 + 2 * 10)
+
+struct entry
+{
+  uint64_t offset, time;
+};
+
+static int fd = -1;
+static pthread_t writer;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static struct ring buffer;
+static int closing;
+
+// Only touched by the relay.
+static uint64_t offset;           // File offset of the next record.
+static long long start, last;     // Monotonic times.
+static uint64_t lost;             // Bytes not recorded yet.
+static struct entry entries[INDEX_ENTRIES];
+static int nentries;
+static uint64_t last_index;
+static uint64_t since_entry;
+static long long entry_time;
+
+static size_t number (unsigned char *p, uint64_t value)
+{
+  size_t n = 0;
+
+  do
+    {
+      p[n] = value & 0x7f;
+      value >>= 7;
+      if (value)
+	p[n] |= 0x80;
+      n++;
+    }
+  while (value);
+
+  return n;
+}
+
+static void put (const void *data, size_t n)
+{
+  ring_put(&buffer, data, n);
+  offset += n;
+}
+
+// Put a record header and its data in the buffer in one go, or
+// nothing at all if it doesn't fit.
+static int put_record (int type, uint64_t a, uint64_t b, int two,
+		       const char *data, size_t n)
+{
+  unsigned char header[RECORD_HEADER_MAX];
+  size_t length;
+  int ok;
+
+  header[0] = type;
+  length = 1 + number(header + 1, a);
+  if (two)
+    length += number(header + length, b);
+
+  pthread_mutex_lock(&lock);
+  ok = ring_room(&buffer) >= length + n;
+  if (ok)
+    {
+      put(header, length);
+      put(data, n);
+      pthread_cond_signal(&wake);
+    }
+  pthread_mutex_unlock(&lock);
+
+  return ok;
+}
+
+static void put_index (void)
+{
+  unsigned char data[INDEX_ENTRIES * 20];
+  size_t n = 0;
+  uint64_t here = offset;
+  int i;
+
+  for (i = 0; i < nentries; i++)
+    {
+      n += number(data + n, entries[i].offset);
+      n += number(data + n, entries[i].time);
+    }
+
+  // If it doesn't fit, those entries are lost, which only makes
+  // seeking slower.
+  if (put_record(RECORD_INDEX, last_index, nentries, 1, (char *)data, n))
+    last_index = here;
+  nentries = 0;
+}
+
+void record_data (const char *data, size_t n)
+{
+  uint64_t here;
+  long long now;
+
+  if (fd == -1 || n == 0)
+    return;
+
+  now = monotonic_usec();
+
+  if (lost && put_record(RECORD_GAP, lost, 0, 0, NULL, 0))
+    lost = 0;
+
+  here = offset;
+  if (lost || !put_record(RECORD_DATA, now - last, n, 1, data, n))
+    {
+      lost += n;
+      return;
+    }
+  last = now;
+
+  if (since_entry >= INDEX_BYTES || now - entry_time >= INDEX_USEC)
+    {
+      entries[nentries].offset = here;
+      entries[nentries].time = now - start;
+      since_entry = 0;
+      entry_time = now;
+      if (++nentries == INDEX_ENTRIES)
+	put_index();
+    }
+  since_entry += n;
+}
+
+static void *write_buffer (void *arg)
+{
+  size_t n;
+  char *data;
+  ssize_t rc;
+
+  pthread_mutex_lock(&lock);
+  for (;;)
+    {
+      while (ring_empty(&buffer) && !closing)
+	pthread_cond_wait(&wake, &lock);
+      if (ring_empty(&buffer))
+	break;
+
+      // The relay only adds after the pending data, so this part can
+      // be written without the lock.
+      data = ring_pending(&buffer, &n);
+      pthread_mutex_unlock(&lock);
+      rc = write(fd, data, n);
+      pthread_mutex_lock(&lock);
+
+      if (rc < 0 && errno == EINTR)
+	continue;
+      if (rc <= 0)
+	{
+	  // Recording is over, but the relay goes on.
+	  ring_consume(&buffer, ring_used(&buffer));
+	  continue;
+	}
+      ring_consume(&buffer, rc);
+    }
+  pthread_mutex_unlock(&lock);
+
+  return NULL;
+}
+
+static void little_endian (unsigned char *p, uint64_t value)
+{
+  int i;
+
+  for (i = 0; i < 8; i++)
+    p[i] = value >> (8 * i);
+}
+
+// Write the last index and the footer, and wait for the writer.
+static void record_close (void)
+{
+  unsigned char footer[RECORD_FOOTER_SIZE];
+
+  if (lost)
+    put_record(RECORD_GAP, lost, 0, 0, NULL, 0);
+  if (nentries > 0 || last_index == 0)
+    put_index();
+
+  little_endian(footer, last_index);
+  memcpy(footer + 8, RECORD_FOOTER, 8);
+  pthread_mutex_lock(&lock);
+  if (ring_room(&buffer) >= sizeof footer)
+    put(footer, sizeof footer);
+  closing = 1;
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+
+  pthread_join(writer, NULL);
+  close(fd);
+  fd = -1;
+}
+
+void record_open (const char *path)
+{
+  unsigned char header[RECORD_HEADER_SIZE];
+  struct timeval tv;
+  sigset_t all, old;
+
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd == -1)
+    fatal("Error %d on open %s", errno, path);
+
+  ring_init(&buffer, BUFFER_SIZE);
+
+  gettimeofday(&tv, NULL);
+  memcpy(header, RECORD_MAGIC, RECORD_MAGIC_SIZE);
+  little_endian(header + 8, tv.tv_sec * 1000000ULL + tv.tv_usec);
+  put(header, sizeof header);
+
+  // The first output gets an index entry.
+  start = last = entry_time = monotonic_usec();
+  since_entry = INDEX_BYTES;
+
+  // Signals are for the relay.
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  if (pthread_create(&writer, NULL, write_buffer, NULL) != 0)
+    fatal("Error creating recording thread");
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  atexit(record_close);
+}
@@ -0,0 +1,64 @@
+/*
+ * Session recordings.
+ *
+ * A recording is a header, then records, then a footer:
+ *
+ *   header  "PTYREC\0\1", start time in microseconds since the epoch
+ *           as 8 bytes little endian.
+ *   'D'     output data: microseconds since the previous 'D' record,
+ *           length, and that many bytes.
+ *   'G'     a gap: this many bytes of output were lost because the
+ *           writer fell behind.
+ *   'I'     seek index: the offset of the previous 'I' record or 0,
+ *           a count, then count pairs of the offset of a 'D' record
+ *           and its time in microseconds since the start.
+ *   footer  offset of the last 'I' record as 8 bytes little endian,
+ *           then "PTYRECIX".
+ *
+ * Numbers in records are unsigned LEB128.  A recording cut short has
+ * no footer, and can only be read from the start.
+ */
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RECORD_MAGIC "PTYREC\0\1"
+#define RECORD_FOOTER "PTYRECIX"
+#define RECORD_MAGIC_SIZE 8
+#define RECORD_HEADER_SIZE 16
+#define RECORD_FOOTER_SIZE 16
+
+#define RECORD_DATA  'D'
+#define RECORD_GAP   'G'
+#define RECORD_INDEX 'I'
+
+extern void record_open (const char *path);
+extern void record_data (const char *data, size_t n);
+
+// Play a recording back on standard output.  Never returns.
+extern void replay (const char *path, double speed, long long start);
+
+// Decode an unsigned LEB128 number.  Returns the bytes used, or 0 if
+// it runs past end.
+static inline size_t record_number (const unsigned char *p,
+				    const unsigned char *end, uint64_t *value)
+{
+  const unsigned char *start = p;
+  int shift = 0;
+
+  *value = 0;
+  while (p < end && shift < 64)
+    {
+      *value |= (uint64_t)(*p & 0x7f) << shift;
+      if (!(*p++ & 0x80))
+	return p - start;
+      shift += 7;
+    }
+
+  return 0;
+}
+
+#endif
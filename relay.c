@@ -0,0 +1,768 @@
+/*
+ * Relay data between standard input and output and the master side of
+ * the pty.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "pty-stdio.h"
+#include "relay.h"
+#include "event.h"
+#include "ring.h"
+#include "lines.h"
+#include "compress.h"
+#include "net.h"
+#include "shm.h"
+#include "resize.h"
+#include "child.h"
+#include "stage.h"
+#include "interrupt.h"
+#include "rate.h"
+#include "expect.h"
+
+#if defined(__linux__) && defined(SPLICE_F_NONBLOCK)
+#define HAVE_SPLICE
+#endif
+
+static int old_flags[3] = { -1, -1, -1 };
+
+static void restore_flags (void)
+{
+  int fd;
+
+  for (fd = 0; fd <= 2; fd++)
+    if (old_flags[fd] != -1)
+      fcntl(fd, F_SETFL, old_flags[fd]);
+}
+
+void set_nonblock (int fd)
+{
+  int flags;
+
+  flags = fcntl(fd, F_GETFL);
+  if (flags == -1)
+    fatal("Error %d on fcntl()", errno);
+
+  // Standard input and output may be shared with other processes, so
+  // put them back as they were on exit.
+  if (fd <= 2 && old_flags[fd] == -1)
+    {
+      if (old_flags[0] == -1 && old_flags[1] == -1 && old_flags[2] == -1)
+	atexit(restore_flags);
+      old_flags[fd] = flags;
+    }
+
+  if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    fatal("Error %d on fcntl()", errno);
+}
+
+void direction_init (struct direction *d, const char *in_name,
+		     int in, const char *out_name, int out)
+{
+  d->in_name = in_name;
+  d->out_name = out_name;
+  d->in = in;
+  d->out = out;
+  ring_init(&d->ring, config.buffer_size);
+  d->ready = 0;
+  d->writable = 1;
+  d->eof = 0;
+  d->gone = 0;
+  d->pipe[0] = d->pipe[1] = -1;
+  d->piped = 0;
+  d->stalled = 0;
+  d->coalesce = 0;
+  d->since = 0;
+  d->count = out == 1 ? &stats.output : &stats.input;
+  d->scratch = NULL;
+  d->coded.data = NULL;
+  d->shm = NULL;
+  d->chain = NULL;
+  d->quantum = 0;
+  d->limited = 0;
+}
+
+#ifdef HAVE_SPLICE
+// Move data from the input to the output through a pipe with splice.
+// Splicing straight to an output that is a pipe would save nothing
+// but a pipe, and EAGAIN wouldn't tell which side is blocking.
+static void splice_init (struct direction *d)
+{
+  int size;
+
+  // Splicing to files opened for appending is not supported.
+  if (fcntl(d->out, F_GETFL) & O_APPEND)
+    return;
+
+  if (pipe2(d->pipe, O_NONBLOCK | O_CLOEXEC) == -1)
+    {
+      d->pipe[0] = d->pipe[1] = -1;
+      return;
+    }
+
+  // Make the pipe about as big as the ring, and the ring big enough
+  // to take the pipe contents if splice turns out not to work.
+  fcntl(d->pipe[1], F_SETPIPE_SZ, (int)config.buffer_size);
+  size = fcntl(d->pipe[1], F_GETPIPE_SZ);
+  if (size > 0 && (size_t)size > d->ring.size)
+    {
+      free(d->ring.data);
+      ring_init(&d->ring, size);
+    }
+}
+
+// Splice isn't supported for this pair of file descriptors.  Take
+// back what's in the pipe and go on with read and write.
+static void splice_fallback (struct direction *d)
+{
+  ssize_t rc;
+  size_t n;
+  char *space;
+
+  while (d->piped > 0)
+    {
+      space = ring_space(&d->ring, &n);
+      rc = read(d->pipe[0], space, n);
+      if (rc <= 0)
+	break;
+      ring_produce(&d->ring, rc);
+      d->piped -= rc;
+    }
+
+  close(d->pipe[0]);
+  close(d->pipe[1]);
+  d->pipe[0] = d->pipe[1] = -1;
+  d->piped = 0;
+  d->stalled = 0;
+}
+
+static int splice_fill (struct direction *d, size_t n)
+{
+  ssize_t rc;
+
+  rc = splice(d->in, NULL, d->pipe[1], NULL, n,
+	      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (rc < 0 && errno == EAGAIN && d->piped > 0)
+    {
+      // Either side could be blocking.  Assume the pipe, and find out
+      // when it's empty.
+      d->stalled = 1;
+    }
+  else if (rc < 0 && errno == EINVAL)
+    {
+      // Try again with read.
+      splice_fallback(d);
+      errno = EINTR;
+    }
+  else if (rc > 0)
+    d->piped += rc;
+
+  return rc;
+}
+
+static int splice_flush (struct direction *d, size_t n)
+{
+  ssize_t rc;
+
+  rc = splice(d->pipe[0], NULL, d->out, NULL, n,
+	      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (rc > 0)
+    {
+      d->piped -= rc;
+      if (d->piped == 0)
+	d->stalled = 0;
+    }
+  else if (rc < 0 && errno == EINVAL)
+    {
+      // Try again with write.
+      splice_fallback(d);
+      errno = EINTR;
+    }
+
+  return rc;
+}
+#else
+static void splice_init (struct direction *d)
+{
+}
+#endif
+
+// Responses to triggers go in with standard input.
+static struct direction *program_input;
+
+static void respond (const char *data, size_t n)
+{
+  struct direction *d = program_input;
+
+  if (n > ring_room(&d->ring))
+    n = ring_room(&d->ring);
+  ring_put(&d->ring, data, n);
+  direction_flush(d);
+}
+
+// Read no more than the rate limit allows.
+static size_t limit (struct direction *d, size_t n)
+{
+  size_t allow;
+
+  if (!d->limited)
+    return n;
+  allow = rate_allow();
+  return n < allow ? n : allow;
+}
+
+// How much to read into the scratch buffer, so what the stages make
+// of it still fits in the ring.
+static size_t scratch_room (struct direction *d)
+{
+  size_t n = chain_fits(d->chain, ring_room(&d->ring));
+
+  return n < config.buffer_size ? n : config.buffer_size;
+}
+
+// Read into the scratch buffer, after the room the stages need in
+// front, and put what comes out of them in the ring.
+static ssize_t scratch_read (struct direction *d)
+{
+  char *data = d->scratch + d->chain->headroom;
+  ssize_t rc;
+  size_t n;
+
+  rc = read(d->in, data, limit(d, scratch_room(d)));
+  if (rc <= 0)
+    return rc;
+
+  n = chain_process(d->chain, &data, rc);
+  ring_put(&d->ring, data, n);
+
+  return rc;
+}
+
+// Expand compressed input into the ring, as far as it has room.
+// Returns whether that made anything.
+static int expand (struct direction *d)
+{
+  size_t before = ring_used(&d->ring), n, used;
+  char *data;
+
+  do
+    {
+      data = ring_pending(&d->coded, &n);
+      used = decompress(&d->ring, data, n);
+      ring_consume(&d->coded, used);
+    }
+  while (used > 0 && used == n && !ring_empty(&d->coded));
+
+  return ring_used(&d->ring) != before;
+}
+
+static int spliced (struct direction *d)
+{
+  return d->pipe[0] != -1;
+}
+
+static size_t pending (struct direction *d)
+{
+  return spliced(d) ? d->piped : ring_used(&d->ring);
+}
+
+// No room to read into, or no tokens to read with.
+static int full (struct direction *d)
+{
+  if (d->limited && rate_allow() == 0)
+    return 1;
+  if (d->shm != NULL)
+    shm_sync(d->shm, &d->ring);
+  if (spliced(d))
+    return d->stalled;
+  if (d->coded.data != NULL)
+    return ring_full(&d->coded);
+  if (d->scratch != NULL)
+    return scratch_room(d) == 0;
+  return ring_full(&d->ring);
+}
+
+// Microseconds left to hold back output while coalescing, or 0 to
+// write it now.
+static long hold_time (struct direction *d)
+{
+  long long left;
+
+  if (d->coalesce == 0 || d->eof || pending(d) >= d->coalesce)
+    return 0;
+
+  left = d->since + config.coalesce_usec - monotonic_usec();
+  return left > 0 ? left : 0;
+}
+
+// Write pending data until the ring is empty or the output is full,
+// or the quantum is used up.
+void direction_flush (struct direction *d)
+{
+  struct counters *count = d->count;
+  size_t left = d->quantum ? d->quantum : (size_t)-1;
+  struct iovec iov[2];
+  ssize_t rc;
+  size_t n, want;
+
+  // The consumer takes it from the ring itself.
+  if (d->shm != NULL)
+    {
+      shm_publish(d->shm, &d->ring);
+      return;
+    }
+
+  if (hold_time(d) > 0)
+    return;
+
+  while (d->writable && left > 0 && (want = pending(d)) > 0)
+    {
+      if (want > left)
+	want = left;
+      count->writes++;
+#ifdef HAVE_SPLICE
+      if (spliced(d))
+	rc = splice_flush(d, want);
+      else
+#endif
+	{
+	  // Both parts of a wrapped ring in one go.
+	  iov[0].iov_base = ring_pending(&d->ring, &n);
+	  iov[0].iov_len = n < want ? n : want;
+	  iov[1].iov_base = d->ring.data;
+	  iov[1].iov_len = want - iov[0].iov_len;
+	  rc = writev(d->out, iov, iov[1].iov_len ? 2 : 1);
+	}
+      if (rc < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  if (errno == EAGAIN || errno == EWOULDBLOCK)
+	    {
+	      d->writable = 0;
+	      if (!count->blocked_since)
+		count->blocked_since = monotonic_usec();
+	      return;
+	    }
+	  // The child has closed the pty, or the connection is gone.
+	  // Nobody wants the rest.
+	  if ((errno == EIO || errno == EPIPE || errno == ECONNRESET)
+	      && !spliced(d))
+	    {
+	      ring_consume(&d->ring, ring_used(&d->ring));
+	      d->gone = errno != EIO;
+	      return;
+	    }
+	  fatal("Error %d on write %s", errno, d->out_name);
+	}
+
+      if (count->blocked_since)
+	{
+	  count->blocked_usec += monotonic_usec() - count->blocked_since;
+	  count->blocked_since = 0;
+	}
+      count->bytes += rc;
+      if ((size_t)rc < want)
+	count->short_writes++;
+      if (!spliced(d))
+	ring_consume(&d->ring, rc);
+      left -= rc;
+    }
+}
+
+// The input is done.  Put out the end of a compressed stream.
+static void end_of_input (struct direction *d)
+{
+  d->ready = 0;
+  d->eof = 1;
+  if (d->chain != NULL)
+    {
+      chain_close(d->chain);
+      direction_flush(d);
+    }
+}
+
+// The interrupt character goes to the program ahead of the input it
+// hasn't taken yet, which the pty would discard anyway.  Data is what
+// was just put in the ring.
+static void jump_queue (struct direction *d, const char *data, size_t n)
+{
+  size_t end = interrupt_find(d->out, data, n);
+
+  if (end == 0)
+    return;
+  ring_consume(&d->ring, ring_used(&d->ring) - (n - end));
+  interrupt_send(d->out);
+}
+
+// Read while there's room in the ring, and pass it on right away.
+// When draining, keep reading until the input would block, but at most
+// config.drain times so the other direction gets its turn.
+static void fill (struct direction *d)
+{
+  ssize_t rc;
+  size_t n;
+  char *space;
+  int i, empty;
+
+  for (i = 0; i < (config.drain ? config.drain : 1); i++)
+    {
+      // A full ring applies backpressure: stop reading until the
+      // output has taken some.
+      if (!d->ready || full(d))
+	break;
+
+      empty = !pending(d);
+      d->count->reads++;
+
+#ifdef HAVE_SPLICE
+      if (spliced(d))
+	rc = splice_fill(d, limit(d, config.buffer_size));
+      else
+#endif
+      if (d->scratch != NULL)
+	rc = scratch_read(d);
+      else if (d->coded.data != NULL)
+	{
+	  space = ring_space(&d->coded, &n);
+	  rc = read(d->in, space, n);
+	  if (rc > 0)
+	    {
+	      ring_produce(&d->coded, rc);
+	      expand(d);
+	    }
+	}
+      else
+	{
+	  space = ring_space(&d->ring, &n);
+	  rc = read(d->in, space, limit(d, n));
+	  if (rc > 0)
+	    {
+	      ring_produce(&d->ring, rc);
+	      if (d->chain != NULL)
+		chain_process(d->chain, &space, rc);
+	      if (d == program_input && config.interrupt)
+		jump_queue(d, space, rc);
+	    }
+	}
+      if (rc < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  if (errno == EAGAIN || errno == EWOULDBLOCK)
+	    {
+	      // If the pipe is stalled, the input may still have data.
+	      if (!full(d))
+		d->ready = 0;
+	      break;
+	    }
+
+	  // The master side reports EIO when the child is gone, and a
+	  // connection may be reset.
+	  if (errno != EIO && errno != ECONNRESET)
+	    fatal("Error %d on read %s", errno, d->in_name);
+	  rc = 0;
+	}
+
+      if (rc == 0)
+	{
+	  end_of_input(d);
+	  break;
+	}
+
+      if (d->limited)
+	rate_take(rc);
+      stats_buffered(d->count, pending(d));
+      if (empty && d->coalesce)
+	d->since = monotonic_usec();
+      direction_flush(d);
+    }
+
+  // End a compressed block when there's no more to read for now, so
+  // the other side sees all output so far.
+  if (d->chain != NULL && d->chain->transforms && !d->eof)
+    {
+      chain_flush(d->chain);
+      direction_flush(d);
+    }
+
+  // Without draining, the engine is level-triggered and will report
+  // the input again if there's more.
+  if (!config.drain)
+    d->ready = 0;
+}
+
+static int wants_read (struct direction *d)
+{
+  return !d->eof && !full(d);
+}
+
+static int wants_write (struct direction *d)
+{
+  return !d->writable && pending(d) && hold_time(d) == 0;
+}
+
+// Can make progress without waiting for the engine: input cut short
+// by draining, or output cut short by the quantum.
+static int runnable (struct direction *d)
+{
+  return (d->ready && wants_read(d))
+    || (d->quantum && d->writable && pending(d) && hold_time(d) == 0);
+}
+
+// A client has connected, or the connection to the server is up.
+// It starts with the scrollback, and new streams if compressing.
+static void online (struct event_engine *engine, struct direction *input,
+		    struct direction *output, int edge)
+{
+  ring_consume(&output->ring, ring_used(&output->ring));
+  if (input->coded.data != NULL)
+    ring_consume(&input->coded, ring_used(&input->coded));
+  net_resume(&output->ring);
+
+  input->eof = input->ready = 0;
+  output->writable = 1;
+  output->gone = 0;
+  event_add(engine, 0, EVENT_READ | edge, NULL);
+  event_add(engine, 1, edge, NULL);
+}
+
+static void offline (struct event_engine *engine)
+{
+  event_remove(engine, 0);
+  event_remove(engine, 1);
+  net_lost(engine);
+}
+
+void master (int fdm)
+{
+  struct event_engine *engine;
+  struct direction input, output;
+  struct chain chain;
+  struct event ev[8];
+  int i, n, edge = 0, connected = 1, watched;
+  int winch = resize_fd(), exit_fd = child_fd();
+  long long exited = 0;  // When the program exited.
+  long timeout, left;
+  size_t size;
+
+  if (config.threads)
+    threaded_master(fdm);
+
+  // Fall back to the best event engine without io_uring.  Its reads
+  // land in fixed buffers, with no room for line prefixes or
+  // compression, and not in the shared memory ring.  Nor does it ask
+  // the rate limit before reading, or have a queue for responses to
+  // triggers to wait behind keystrokes.
+  if (config.engine != NULL && strcmp(config.engine, "uring") == 0)
+    {
+      if (!lines_active() && !compress_active() && !net_active()
+	  && config.shm == NULL && !rate_active() && !expect_active())
+	uring_master(fdm);
+      config.engine = NULL;
+    }
+
+  direction_init(&input, "standard input", 0, "master pty", fdm);
+  direction_init(&output, "master pty", fdm, "standard output", 1);
+  program_input = &input;
+
+  chain_output(&chain, fdm, &output.ring, respond);
+  output.chain = &chain;
+
+  // Stages that change the data read it from the scratch buffer.
+  if (chain.transforms)
+    {
+      output.scratch = malloc(chain.headroom + config.buffer_size);
+      if (output.scratch == NULL)
+	fatal("Out of memory");
+    }
+
+  // Leave room for what a full read can become, such as a prefix on
+  // every byte.
+  size = chain_most(&chain, config.buffer_size);
+  if (size > output.ring.size)
+    {
+      free(output.ring.data);
+      ring_init(&output.ring, size);
+    }
+
+  if (compress_active())
+    ring_init(&input.coded, config.buffer_size);
+
+  // Room for all of the scrollback, compressed or not.
+  if (net_active() && output.ring.size < 2 * net_scrollback())
+    {
+      free(output.ring.data);
+      ring_init(&output.ring, 2 * net_scrollback());
+    }
+
+  // Output goes in the shared memory ring instead of standard output.
+  if (config.shm != NULL)
+    output.shm = shm_create(config.shm, output.ring.size, &output.ring);
+
+  // The stages need to see the data, and the shared memory ring needs
+  // it in user space.
+  if (config.splice && chain.n == 0 && output.shm == NULL)
+    splice_init(&output);
+
+  // Coalescing is for pipes and files, a terminal wants output now.
+  if (!isatty(1) && output.shm == NULL)
+    output.coalesce = config.coalesce;
+  if (output.shm == NULL)
+    output.quantum = config.quantum;
+  output.limited = rate_active();
+
+  // Writes must never block the loop, buffered data waits for the
+  // engine to report the output writable instead.
+  if (output.shm == NULL)
+    set_nonblock(1);
+  set_nonblock(fdm);
+
+  // Draining until EAGAIN needs non-blocking input too, and then
+  // edge-triggered notification is enough.
+  if (config.drain)
+    {
+      set_nonblock(0);
+      edge = EVENT_EDGE;
+    }
+
+  // Register standard input, standard output, and master side of PTY
+  // once
+  engine = event_open(config.engine);
+  stats.engine = event_name(engine);
+  event_add(engine, fdm, EVENT_READ | edge, NULL);
+  if (winch != -1)
+    event_add(engine, winch, EVENT_READ, NULL);
+  if (exit_fd != -1)
+    event_add(engine, exit_fd, EVENT_READ, NULL);
+  if (net_active())
+    connected = 0;
+  else
+    {
+      event_add(engine, 0, EVENT_READ | edge, NULL);
+      if (output.shm == NULL)
+	event_add(engine, 1, edge, NULL);
+    }
+  if (net_active() && net_start(engine))
+    {
+      online(engine, &input, &output, edge);
+      connected = 1;
+    }
+
+  for (;;)
+    {
+      stats_check();
+
+      // Watch for reading only when there's room to put the data, and
+      // for writing only when there's data pending.
+      watched = wants_read(&output);
+      event_modify(engine, fdm, (watched ? EVENT_READ : 0)
+		   | (wants_write(&input) ? EVENT_WRITE : 0) | edge, NULL);
+      if (connected)
+	{
+	  event_modify(engine, 0, (wants_read(&input) ? EVENT_READ : 0)
+		       | edge, NULL);
+	  if (output.shm == NULL)
+	    event_modify(engine, 1, (wants_write(&output) ? EVENT_WRITE : 0)
+			 | edge, NULL);
+	}
+
+      // Wait for data from standard input and master side of PTY.
+      // Don't block if a drain was cut short, the engine won't report
+      // those again, or longer than coalesced output may be held.
+      if (runnable(&input) || runnable(&output))
+	timeout = 0;
+      else if (output.coalesce && output.writable && pending(&output))
+	timeout = hold_time(&output);
+      else if (output.shm != NULL && !output.eof && full(&output))
+	timeout = SHM_POLL_USEC;  // No event for the consumer taking some.
+      else
+	timeout = -1;
+      if (!connected && net_timeout() >= 0
+	  && (timeout < 0 || net_timeout() < timeout))
+	timeout = net_timeout();
+      if (exited && !output.eof)
+	{
+	  left = exited + CHILD_LINGER_USEC - monotonic_usec();
+	  if (left > 0 && (timeout < 0 || left < timeout))
+	    timeout = left;
+	}
+
+      // Wake up when the rate limit lets the output be read again.
+      if (output.limited && !output.eof
+	  && (left = rate_wait()) > 0 && (timeout < 0 || left < timeout))
+	timeout = left;
+      n = event_wait(engine, ev, 8, timeout);
+      stats.wakeups++;
+      if (n == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  fatal("Error %d on %s wait", errno, event_name(engine));
+	}
+
+      for (i = 0; i < n; i++)
+	{
+	  if (!connected && net_event(engine, &ev[i]))
+	    {
+	      online(engine, &input, &output, edge);
+	      connected = 1;
+	      continue;
+	    }
+	  if (ev[i].fd == winch)
+	    resize_apply();
+	  if (ev[i].fd == exit_fd && child_reap())
+	    {
+	      event_remove(engine, exit_fd);
+	      exited = monotonic_usec();
+	    }
+	  if (ev[i].fd == 0 && (ev[i].events & EVENT_READ))
+	    input.ready = 1;
+	  if (ev[i].fd == fdm && (ev[i].events & EVENT_READ))
+	    output.ready = 1;
+	  if (ev[i].fd == fdm && (ev[i].events & EVENT_WRITE))
+	    input.writable = 1;
+	  if (ev[i].fd == 1 && (ev[i].events & EVENT_WRITE))
+	    output.writable = 1;
+	}
+
+      // The program has exited, but something else holds the pty open
+      // so there will be no EIO.  Once the master side has had time to
+      // get the last output, and has nothing more, that's the end.
+      // Only the engine watching it can tell it has nothing.
+      if (exited && !output.eof && !output.ready && watched
+	  && monotonic_usec() >= exited + CHILD_LINGER_USEC)
+	end_of_input(&output);
+
+      // Keystrokes first, so they never wait behind a large write of
+      // output.
+      direction_flush(&input);
+      while (input.coded.data != NULL && input.writable && expand(&input))
+	direction_flush(&input);
+      fill(&input);
+      direction_flush(&output);
+      fill(&output);
+
+      // Keep serving the program while there's no connection.
+      if (connected && (input.eof || output.gone) && net_active())
+	{
+	  offline(engine);
+	  connected = 0;
+	}
+      if (!connected && net_check(engine))
+	{
+	  online(engine, &input, &output, edge);
+	  connected = 1;
+	}
+
+      // The child is gone.  Exit when all its output is written, or
+      // published for the consumer to take in its own time.
+      if (output.eof && (!pending(&output) || output.shm != NULL))
+	exit(child_status());
+    }
+}
@@ -0,0 +1,54 @@
+/*
+ * Relay between standard input and output and the pty.
+ */
+
+#ifndef RELAY_H
+#define RELAY_H
+
+#include "ring.h"
+#include "stats.h"
+
+// One direction of the relay.  Data read from the input waits in the
+// ring until the output accepts it.  With splice, it waits in a pipe
+// instead and never enters user space.
+struct direction
+{
+  const char *in_name, *out_name;
+  int in, out;
+  struct ring ring;
+  int ready;     // Input may have more data.
+  int writable;  // Output may accept more data.
+  int eof;
+  int gone;      // Output closed, a connection that was lost.
+  int pipe[2];   // Splice through this pipe, if open.
+  size_t piped;  // Bytes in the pipe.
+  int stalled;   // Pipe too full to splice more into.
+  size_t coalesce;   // Hold output until this much is pending,
+  long long since;   // or it has waited config.coalesce_usec.
+  struct counters *count;
+  char *scratch;     // Filtered input is read here first.
+  struct ring coded; // Compressed input waiting to be expanded.
+  struct shm_ring *shm;  // Output goes here instead, if set.
+  struct chain *chain;   // Stages the data goes through, if any.
+  size_t quantum;    // Most to write at once, or 0 for no limit.
+  int limited;       // Reads are held to the --max-rate.
+};
+
+extern void set_nonblock (int fd);
+extern void direction_init (struct direction *, const char *in_name, int in,
+			    const char *out_name, int out);
+extern void direction_flush (struct direction *);
+
+extern void master (int fdm);
+
+// Returns only if io_uring is not available.
+extern void uring_master (int fdm);
+
+// A thread per direction.  Returns only if the options need the event
+// loop.
+extern void threaded_master (int fdm);
+
+// Relay for several programs, each on its own pty.
+extern void mux_master (int *fdm, int n);
+
+#endif
@@ -0,0 +1,230 @@
+/*
+ * Play a recording made with --record back to standard output.  The
+ * file is mapped, and records are written straight from the mapping
+ * with writev.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "pty-stdio.h"
+#include "record.h"
+
+#define MAX_IOV 64
+
+static const unsigned char *base, *end;
+static struct iovec iov[MAX_IOV];
+static int niov;
+
+static uint64_t little_endian (const unsigned char *p)
+{
+  uint64_t value = 0;
+  int i;
+
+  for (i = 7; i >= 0; i--)
+    value = value << 8 | p[i];
+
+  return value;
+}
+
+static void flush (void)
+{
+  struct iovec *v = iov;
+  ssize_t rc;
+
+  while (niov > 0)
+    {
+      rc = writev(1, v, niov);
+      if (rc < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  fatal("Error %d on write standard output", errno);
+	}
+
+      while (niov > 0 && (size_t)rc >= v->iov_len)
+	{
+	  rc -= v->iov_len;
+	  v++;
+	  niov--;
+	}
+      if (niov > 0)
+	{
+	  v->iov_base = (char *)v->iov_base + rc;
+	  v->iov_len -= rc;
+	}
+    }
+}
+
+static void output (const unsigned char *data, size_t n)
+{
+  if (niov == MAX_IOV)
+    flush();
+  iov[niov].iov_base = (void *)data;
+  iov[niov].iov_len = n;
+  niov++;
+}
+
+// Find where to start playing from the index.  Returns the offset of a
+// data record at or before the start time, and its time in *time, with
+// *indexed set.  Without an entry early enough, returns the first
+// record, with *time 0 and *indexed clear.
+static size_t seek (long long start, uint64_t *time, int *indexed)
+{
+  const unsigned char *p;
+  uint64_t index, previous, count, offset, t, best = 0;
+  size_t n;
+
+  *time = 0;
+  *indexed = 0;
+  if (end - base < RECORD_HEADER_SIZE + RECORD_FOOTER_SIZE
+      || memcmp(end - 8, RECORD_FOOTER, 8) != 0)
+    return RECORD_HEADER_SIZE;
+  end -= RECORD_FOOTER_SIZE;
+
+  // Index records link back from the last, so walk them until one
+  // starts early enough.
+  for (index = little_endian(end); index != 0; index = previous)
+    {
+      p = base + index;
+      if (index >= (uint64_t)(end - base) || *p++ != RECORD_INDEX
+	  || (n = record_number(p, end, &previous)) == 0
+	  || (p += n, n = record_number(p, end, &count)) == 0)
+	break;
+      p += n;
+
+      while (count-- > 0)
+	{
+	  if ((n = record_number(p, end, &offset)) == 0)
+	    return RECORD_HEADER_SIZE;
+	  p += n;
+	  if ((n = record_number(p, end, &t)) == 0)
+	    return RECORD_HEADER_SIZE;
+	  p += n;
+	  if ((long long)t > start || offset >= (uint64_t)(end - base))
+	    break;
+	  best = offset;
+	  *time = t;
+	}
+      if (best != 0)
+	{
+	  *indexed = 1;
+	  return best;
+	}
+    }
+
+  *time = 0;
+  return RECORD_HEADER_SIZE;
+}
+
+static void wait_until (long long usec)
+{
+  struct timespec ts;
+  long long left;
+
+  left = usec - monotonic_usec();
+  if (left <= 0)
+    return;
+
+  // Write what's due before sleeping.
+  flush();
+  ts.tv_sec = left / 1000000;
+  ts.tv_nsec = left % 1000000 * 1000;
+  while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+    ;
+}
+
+// Play at speed times the original pace, or as fast as possible if
+// speed is 0, from start microseconds into the recording.
+void replay (const char *path, double speed, long long start)
+{
+  const unsigned char *p;
+  uint64_t time, delta, length;
+  long long began;
+  struct stat st;
+  size_t n;
+  int fd, indexed;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+    fatal("Error %d on open %s", errno, path);
+  if (fstat(fd, &st) == -1)
+    fatal("Error %d on fstat %s", errno, path);
+  if (st.st_size < RECORD_HEADER_SIZE)
+    fatal("Not a recording: %s", path);
+
+  base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (base == MAP_FAILED)
+    fatal("Error %d on mmap %s", errno, path);
+  close(fd);
+  madvise((void *)base, st.st_size, MADV_SEQUENTIAL);
+  end = base + st.st_size;
+
+  if (memcmp(base, RECORD_MAGIC, RECORD_MAGIC_SIZE) != 0)
+    fatal("Not a recording: %s", path);
+
+  p = base + seek(start, &time, &indexed);
+  began = monotonic_usec();
+
+  // A record cut short at the end is left out.
+  while (p < end)
+    {
+      int type = *p++;
+
+      if ((n = record_number(p, end, &delta)) == 0)
+	break;
+      p += n;
+
+      if (type == RECORD_GAP)
+	continue;
+      if ((n = record_number(p, end, &length)) == 0)
+	break;
+      p += n;
+      if (type == RECORD_DATA && length > (uint64_t)(end - p))
+	break;
+
+      if (type == RECORD_DATA)
+	{
+	  // The index gives the time of the record it points to.  From
+	  // the header, the first delta counts from the start of the
+	  // recording like the index does.
+	  if (!indexed)
+	    time += delta;
+	  indexed = 0;
+
+	  if ((long long)time >= start)
+	    {
+	      if (speed > 0)
+		wait_until(began + (long long)((time - start) / speed));
+	      output(p, length);
+	    }
+	}
+      else if (type == RECORD_INDEX)
+	{
+	  // Skip the count entries, two numbers each.
+	  for (length *= 2; length > 0; length--)
+	    {
+	      if ((n = record_number(p, end, &delta)) == 0)
+		break;
+	      p += n;
+	    }
+	  if (length > 0)
+	    break;
+	  continue;
+	}
+      else
+	fatal("Invalid record in %s", path);
+
+      p += length;
+    }
+
+  flush();
+  exit(0);
+}
@@ -0,0 +1,87 @@
+/*
+ * Window size changes.  The SIGWINCH handler writes to a pipe that
+ * the event loop watches, so a resize is seen at once and never lost
+ * between a check and the wait, and the loop needs no polling.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include "pty-stdio.h"
+#include "resize.h"
+#include "screen.h"
+
+static int terminal = -1, pty = -1;
+static int self[2] = { -1, -1 };
+
+static void handler (int sig)
+{
+  int saved = errno;
+
+  // If the pipe is full, a wakeup is already on its way.
+  write(self[1], "", 1);
+  errno = saved;
+}
+
+void resize_set (int fdm, int cols, int rows)
+{
+  struct winsize ws;
+
+  memset(&ws, 0, sizeof ws);
+  ws.ws_col = cols;
+  ws.ws_row = rows;
+
+  // The kernel tells the program with SIGWINCH when this changes it.
+  ioctl(fdm, TIOCSWINSZ, &ws);
+  if (screen_active())
+    screen_resize(cols, rows);
+}
+
+static void copy (void)
+{
+  struct winsize ws;
+
+  if (ioctl(terminal, TIOCGWINSZ, &ws) == 0)
+    resize_set(pty, ws.ws_col, ws.ws_row);
+}
+
+void resize_follow (int fd, int fdm)
+{
+  struct sigaction sa;
+
+  terminal = fd;
+  pty = fdm;
+  copy();
+
+  if (pipe(self) == -1)
+    fatal("Error %d on pipe()", errno);
+  fcntl(self[0], F_SETFD, FD_CLOEXEC);
+  fcntl(self[1], F_SETFD, FD_CLOEXEC);
+  fcntl(self[0], F_SETFL, O_NONBLOCK);
+  fcntl(self[1], F_SETFL, O_NONBLOCK);
+
+  // Restart system calls, the pipe is what wakes the loop.
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = handler;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGWINCH, &sa, NULL);
+}
+
+int resize_fd (void)
+{
+  return self[0];
+}
+
+void resize_apply (void)
+{
+  char buffer[64];
+
+  // Several signals make one resize.
+  while (read(self[0], buffer, sizeof buffer) > 0)
+    ;
+  copy();
+}
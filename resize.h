@@ -0,0 +1,20 @@
+/*
+ * Follow the size of the terminal onto the pty.
+ */
+
+#ifndef RESIZE_H
+#define RESIZE_H
+
+// Give the pty this size, and the screen model too.
+extern void resize_set (int fdm, int cols, int rows);
+
+// Copy the size of the terminal at fd to the pty now and on every
+// SIGWINCH.
+extern void resize_follow (int fd, int fdm);
+
+// Readable after a SIGWINCH, or -1 when not following.  The event
+// loop then calls resize_apply.
+extern int resize_fd (void);
+extern void resize_apply (void);
+
+#endif
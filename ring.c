@@ -0,0 +1,35 @@
+/*
+ * Ring buffer.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "pty-stdio.h"
+#include "ring.h"
+
+void ring_init (struct ring *r, size_t size)
+{
+  r->data = malloc(size);
+  if (r->data == NULL)
+    fatal("Out of memory");
+  r->size = size;
+  r->head = r->tail = 0;
+}
+
+// Copy data in.  The caller makes sure there's room.
+void ring_put (struct ring *r, const char *data, size_t n)
+{
+  size_t length;
+  char *space;
+
+  while (n > 0)
+    {
+      space = ring_space(r, &length);
+      if (length > n)
+	length = n;
+      memcpy(space, data, length);
+      ring_produce(r, length);
+      data += length;
+      n -= length;
+    }
+}
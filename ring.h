@@ -0,0 +1,72 @@
+/*
+ * Ring buffer holding data on its way from one file descriptor to
+ * another.
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+
+struct ring
+{
+  char *data;
+  size_t size;
+  size_t head;  // Total bytes put in.
+  size_t tail;  // Total bytes taken out.
+};
+
+extern void ring_init (struct ring *, size_t size);
+extern void ring_put (struct ring *, const char *data, size_t n);
+
+static inline size_t ring_used (const struct ring *r)
+{
+  return r->head - r->tail;
+}
+
+static inline size_t ring_room (const struct ring *r)
+{
+  return r->size - ring_used(r);
+}
+
+static inline int ring_full (const struct ring *r)
+{
+  return ring_used(r) == r->size;
+}
+
+static inline int ring_empty (const struct ring *r)
+{
+  return r->head == r->tail;
+}
+
+// Contiguous free space to read into.
+static inline char *ring_space (struct ring *r, size_t *length)
+{
+  size_t offset = r->head % r->size;
+  size_t free = r->size - ring_used(r);
+
+  *length = r->size - offset < free ? r->size - offset : free;
+  return r->data + offset;
+}
+
+// Contiguous pending data to write out.
+static inline char *ring_pending (struct ring *r, size_t *length)
+{
+  size_t offset = r->tail % r->size;
+  size_t used = ring_used(r);
+
+  *length = r->size - offset < used ? r->size - offset : used;
+  return r->data + offset;
+}
+
+static inline void ring_produce (struct ring *r, size_t n)
+{
+  r->head += n;
+}
+
+static inline void ring_consume (struct ring *r, size_t n)
+{
+  r->tail += n;
+}
+
+#endif
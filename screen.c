@@ -0,0 +1,879 @@
+/*
+ * Terminal emulator for the program's output, covering what VT100 and
+ * xterm programs commonly use: cursor movement, erasing, insertion and
+ * deletion, scroll regions, SGR attributes with 256 colors, and the
+ * alternate screen.  Every character takes one cell.
+ *
+ * Cells are packed in one array, row after row.  Each change marks its
+ * row in a bitmap, and only marked rows are encoded again for a
+ * report.  The encoding of the others is kept from the last time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include "pty-stdio.h"
+#include "screen.h"
+
+#define ESC 033
+
+#define A_BOLD      0x001
+#define A_DIM       0x002
+#define A_ITALIC    0x004
+#define A_UNDERLINE 0x008
+#define A_BLINK     0x010
+#define A_INVERSE   0x020
+#define A_HIDDEN    0x040
+#define A_STRIKE    0x080
+#define A_FG        0x100   // fg is set, not the default.
+#define A_BG        0x200
+
+#define MAX_PARAMS 16
+
+// Longest encoding of a cell: an SGR sequence with everything set,
+// and a character escaped for JSON.
+#define CELL_ROOM 64
+
+struct cell
+{
+  uint32_t ch;
+  uint8_t fg, bg;
+  uint16_t attr;
+};
+
+enum { GROUND, ESCAPE, ESCAPE_SKIP, CSI, STRING, STRING_ESCAPE };
+
+static int cols, rows;
+static struct cell *grid, *other;  // Shown, and the one not shown.
+static int alternate;              // The alternate screen is shown.
+static uint64_t *dirty;
+static int whole;                  // Report every row next time.
+
+static int x, y, wrap_pending;
+static int top, bottom;            // Scroll region.
+static int autowrap = 1, cursor_visible = 1;
+static struct cell pen = { ' ', 0, 0, 0 };
+static struct { int x, y; struct cell pen; } saved;
+
+static int state = GROUND;
+static int params[MAX_PARAMS], nparams;
+static char private, intermediate;
+static uint32_t code;              // UTF-8 sequence so far,
+static int more;                   // and bytes still to come,
+static uint32_t least;             // and the least it may encode.
+
+static char **text;                // Encoded rows,
+static size_t *length;             // and their lengths.
+
+// A new size, columns in the high half, or 0.  Another thread may set
+// it, the model changes in the thread that feeds it.
+static uint64_t resized;
+
+int screen_active (void)
+{
+  return config.screen != NULL;
+}
+
+static void mark (int row)
+{
+  dirty[row / 64] |= 1ULL << (row % 64);
+}
+
+static void mark_rows (int from, int to)
+{
+  int row;
+
+  for (row = from; row <= to; row++)
+    mark(row);
+}
+
+static struct cell blank (void)
+{
+  struct cell c = { ' ', 0, pen.bg, pen.attr & A_BG };
+  return c;
+}
+
+static void erase (int row, int from, int to)
+{
+  struct cell *c = grid + row * cols, b = blank();
+  int i;
+
+  for (i = from; i < to; i++)
+    c[i] = b;
+  mark(row);
+}
+
+static void scroll_up (int from, int to, int n)
+{
+  int i;
+
+  if (n > to - from + 1)
+    n = to - from + 1;
+  memmove(grid + from * cols, grid + (from + n) * cols,
+	  (to - from + 1 - n) * cols * sizeof *grid);
+  for (i = to - n + 1; i <= to; i++)
+    erase(i, 0, cols);
+  mark_rows(from, to);
+}
+
+static void scroll_down (int from, int to, int n)
+{
+  int i;
+
+  if (n > to - from + 1)
+    n = to - from + 1;
+  memmove(grid + (from + n) * cols, grid + from * cols,
+	  (to - from + 1 - n) * cols * sizeof *grid);
+  for (i = from; i < from + n; i++)
+    erase(i, 0, cols);
+  mark_rows(from, to);
+}
+
+static void linefeed (void)
+{
+  if (y == bottom)
+    scroll_up(top, bottom, 1);
+  else if (y < rows - 1)
+    y++;
+}
+
+static void reverse_index (void)
+{
+  if (y == top)
+    scroll_down(top, bottom, 1);
+  else if (y > 0)
+    y--;
+}
+
+static void move (int col, int row)
+{
+  x = col < 0 ? 0 : col >= cols ? cols - 1 : col;
+  y = row < 0 ? 0 : row >= rows ? rows - 1 : row;
+  wrap_pending = 0;
+}
+
+static void put_char (uint32_t ch)
+{
+  struct cell *c;
+
+  if (wrap_pending)
+    {
+      x = 0;
+      linefeed();
+      wrap_pending = 0;
+    }
+
+  c = grid + y * cols + x;
+  *c = pen;
+  c->ch = ch;
+  mark(y);
+
+  if (x < cols - 1)
+    x++;
+  else
+    wrap_pending = autowrap;
+}
+
+static void reset (void)
+{
+  struct cell none = { ' ', 0, 0, 0 };
+  int row;
+
+  pen = none;
+  if (alternate)
+    {
+      struct cell *swap = grid;
+      grid = other;
+      other = swap;
+      alternate = 0;
+    }
+  for (row = 0; row < rows; row++)
+    erase(row, 0, cols);
+  top = 0;
+  bottom = rows - 1;
+  autowrap = cursor_visible = 1;
+  move(0, 0);
+  saved.x = saved.y = 0;
+  saved.pen = pen;
+}
+
+static void apply_size (int new_cols, int new_rows)
+{
+  struct cell *g[2], none = { ' ', 0, 0, 0 }, *old[2] = { grid, other };
+  int i, row, col;
+
+  if (new_cols <= 0 || new_rows <= 0
+      || (new_cols == cols && new_rows == rows))
+    return;
+
+  // Keep what fits of both screens.
+  for (i = 0; i < 2; i++)
+    {
+      g[i] = malloc(new_cols * new_rows * sizeof *grid);
+      if (g[i] == NULL)
+	fatal("Out of memory");
+      for (row = 0; row < new_rows; row++)
+	for (col = 0; col < new_cols; col++)
+	  g[i][row * new_cols + col] = row < rows && col < cols
+	    ? old[i][row * cols + col] : none;
+      free(old[i]);
+    }
+  grid = g[0];
+  other = g[1];
+
+  for (row = 0; row < rows; row++)
+    free(text[row]);
+  free(text);
+  free(length);
+  free(dirty);
+
+  cols = new_cols;
+  rows = new_rows;
+  text = calloc(rows, sizeof *text);
+  length = calloc(rows, sizeof *length);
+  dirty = calloc((rows + 63) / 64, sizeof *dirty);
+  if (text == NULL || length == NULL || dirty == NULL)
+    fatal("Out of memory");
+  for (row = 0; row < rows; row++)
+    {
+      text[row] = malloc(cols * CELL_ROOM + 16);
+      if (text[row] == NULL)
+	fatal("Out of memory");
+    }
+
+  mark_rows(0, rows - 1);
+  whole = 1;
+  top = 0;
+  bottom = rows - 1;
+  move(x, y);
+}
+
+void screen_resize (int new_cols, int new_rows)
+{
+  if (new_cols <= 0 || new_rows <= 0)
+    return;
+  __atomic_store_n(&resized, (uint64_t)new_cols << 32 | new_rows,
+		   __ATOMIC_RELEASE);
+}
+
+// Take up a size set since the last look.
+static void take_size (void)
+{
+  uint64_t size;
+
+  if (__atomic_load_n(&resized, __ATOMIC_RELAXED) == 0)
+    return;
+  size = __atomic_exchange_n(&resized, 0, __ATOMIC_ACQUIRE);
+  if (size != 0)
+    apply_size(size >> 32, size & 0xffffffff);
+}
+
+void screen_start (int fdm)
+{
+  struct winsize ws;
+
+  if (ioctl(fdm, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0 || ws.ws_row == 0)
+    {
+      ws.ws_col = 80;
+      ws.ws_row = 24;
+    }
+  apply_size(ws.ws_col, ws.ws_row);
+  reset();
+}
+
+static int param (int i, int fallback)
+{
+  return i < nparams && params[i] != 0 ? params[i] : fallback;
+}
+
+// The nearest color in the 6x6x6 cube.
+static int cube (int r, int g, int b)
+{
+  return 16 + 36 * ((r * 5 + 127) / 255) + 6 * ((g * 5 + 127) / 255)
+    + (b * 5 + 127) / 255;
+}
+
+// An extended color after 38 or 48, returns the parameters used.
+static int extended (int i, uint8_t *color, uint16_t *attr, int flag)
+{
+  if (i + 1 < nparams && params[i + 1] == 5 && i + 2 < nparams)
+    {
+      *color = params[i + 2];
+      *attr |= flag;
+      return 2;
+    }
+  if (i + 1 < nparams && params[i + 1] == 2 && i + 4 < nparams)
+    {
+      *color = cube(params[i + 2] & 255, params[i + 3] & 255,
+		    params[i + 4] & 255);
+      *attr |= flag;
+      return 4;
+    }
+  return 0;
+}
+
+static void sgr (void)
+{
+  static const uint16_t set[10] =
+    { 0, A_BOLD, A_DIM, A_ITALIC, A_UNDERLINE, A_BLINK, A_BLINK, A_INVERSE,
+      A_HIDDEN, A_STRIKE };
+  static const uint16_t clear[10] =
+    { 0, A_UNDERLINE, A_BOLD | A_DIM, A_ITALIC, A_UNDERLINE, A_BLINK, 0,
+      A_INVERSE, A_HIDDEN, A_STRIKE };
+  int i, p;
+
+  if (nparams == 0)
+    nparams = 1;
+
+  for (i = 0; i < nparams; i++)
+    {
+      p = params[i];
+      if (p == 0)
+	{
+	  pen.attr = 0;
+	  pen.fg = pen.bg = 0;
+	}
+      else if (p < 10)
+	pen.attr |= set[p];
+      else if (p == 21)
+	pen.attr |= A_UNDERLINE;
+      else if (p > 21 && p < 30)
+	pen.attr &= ~clear[p - 20];
+      else if (p >= 30 && p <= 37)
+	pen.fg = p - 30, pen.attr |= A_FG;
+      else if (p == 38)
+	i += extended(i, &pen.fg, &pen.attr, A_FG);
+      else if (p == 39)
+	pen.attr &= ~A_FG;
+      else if (p >= 40 && p <= 47)
+	pen.bg = p - 40, pen.attr |= A_BG;
+      else if (p == 48)
+	i += extended(i, &pen.bg, &pen.attr, A_BG);
+      else if (p == 49)
+	pen.attr &= ~A_BG;
+      else if (p >= 90 && p <= 97)
+	pen.fg = p - 90 + 8, pen.attr |= A_FG;
+      else if (p >= 100 && p <= 107)
+	pen.bg = p - 100 + 8, pen.attr |= A_BG;
+    }
+}
+
+static void switch_screen (int on)
+{
+  struct cell *swap;
+  int row;
+
+  if (on == alternate)
+    return;
+
+  swap = grid;
+  grid = other;
+  other = swap;
+  alternate = on;
+  if (on)
+    for (row = 0; row < rows; row++)
+      erase(row, 0, cols);
+  mark_rows(0, rows - 1);
+}
+
+static void mode (int on)
+{
+  int i;
+
+  if (private != '?')
+    return;
+
+  for (i = 0; i < nparams; i++)
+    switch (params[i])
+      {
+      case 7:
+	autowrap = on;
+	break;
+      case 25:
+	cursor_visible = on;
+	break;
+      case 1049:
+	if (on)
+	  {
+	    saved.x = x;
+	    saved.y = y;
+	    saved.pen = pen;
+	  }
+	switch_screen(on);
+	if (!on)
+	  {
+	    pen = saved.pen;
+	    move(saved.x, saved.y);
+	  }
+	break;
+      case 47:
+      case 1047:
+	switch_screen(on);
+	break;
+      }
+}
+
+static void csi (char final)
+{
+  struct cell *row = grid + y * cols;
+  int n = param(0, 1), i;
+
+  if (intermediate)
+    return;
+  if (private && final != 'h' && final != 'l')
+    return;
+
+  switch (final)
+    {
+    case '@':
+      if (n > cols - x)
+	n = cols - x;
+      memmove(row + x + n, row + x, (cols - x - n) * sizeof *row);
+      erase(y, x, x + n);
+      break;
+    case 'A':
+      move(x, y >= top && y - n < top ? top : y - n);
+      break;
+    case 'B':
+    case 'e':
+      move(x, y <= bottom && y + n > bottom ? bottom : y + n);
+      break;
+    case 'C':
+    case 'a':
+      move(x + n, y);
+      break;
+    case 'D':
+      move(x - n, y);
+      break;
+    case 'E':
+      move(0, y <= bottom && y + n > bottom ? bottom : y + n);
+      break;
+    case 'F':
+      move(0, y >= top && y - n < top ? top : y - n);
+      break;
+    case 'G':
+    case '`':
+      move(n - 1, y);
+      break;
+    case 'H':
+    case 'f':
+      move(param(1, 1) - 1, n - 1);
+      break;
+    case 'd':
+      move(x, n - 1);
+      break;
+    case 'J':
+      if (param(0, 0) == 0)
+	{
+	  erase(y, x, cols);
+	  for (i = y + 1; i < rows; i++)
+	    erase(i, 0, cols);
+	}
+      else if (param(0, 0) == 1)
+	{
+	  for (i = 0; i < y; i++)
+	    erase(i, 0, cols);
+	  erase(y, 0, x + 1);
+	}
+      else
+	for (i = 0; i < rows; i++)
+	  erase(i, 0, cols);
+      break;
+    case 'K':
+      if (param(0, 0) == 0)
+	erase(y, x, cols);
+      else if (param(0, 0) == 1)
+	erase(y, 0, x + 1);
+      else
+	erase(y, 0, cols);
+      break;
+    case 'L':
+      if (y >= top && y <= bottom)
+	scroll_down(y, bottom, n);
+      x = wrap_pending = 0;
+      break;
+    case 'M':
+      if (y >= top && y <= bottom)
+	scroll_up(y, bottom, n);
+      x = wrap_pending = 0;
+      break;
+    case 'P':
+      if (n > cols - x)
+	n = cols - x;
+      memmove(row + x, row + x + n, (cols - x - n) * sizeof *row);
+      erase(y, cols - n, cols);
+      break;
+    case 'X':
+      erase(y, x, x + n < cols ? x + n : cols);
+      break;
+    case 'S':
+      scroll_up(top, bottom, n);
+      break;
+    case 'T':
+      if (nparams <= 1)
+	scroll_down(top, bottom, n);
+      break;
+    case 'm':
+      sgr();
+      break;
+    case 'r':
+      i = param(1, rows);
+      if (i > rows)
+	i = rows;
+      if (n < i)
+	{
+	  top = n - 1;
+	  bottom = i - 1;
+	  move(0, 0);
+	}
+      break;
+    case 'h':
+      mode(1);
+      break;
+    case 'l':
+      mode(0);
+      break;
+    case 's':
+      saved.x = x;
+      saved.y = y;
+      saved.pen = pen;
+      break;
+    case 'u':
+      pen = saved.pen;
+      move(saved.x, saved.y);
+      break;
+    }
+}
+
+static void escape (char final)
+{
+  switch (final)
+    {
+    case '7':
+      saved.x = x;
+      saved.y = y;
+      saved.pen = pen;
+      break;
+    case '8':
+      pen = saved.pen;
+      move(saved.x, saved.y);
+      break;
+    case 'D':
+      linefeed();
+      break;
+    case 'E':
+      x = 0;
+      linefeed();
+      break;
+    case 'M':
+      reverse_index();
+      break;
+    case 'c':
+      reset();
+      break;
+    }
+  wrap_pending = 0;
+}
+
+// C0 controls, which also act in the middle of a control sequence.
+static void control (unsigned char c)
+{
+  switch (c)
+    {
+    case '\b':
+      move(x - 1, y);
+      break;
+    case '\t':
+      move((x / 8 + 1) * 8, y);
+      break;
+    case '\n':
+    case '\v':
+    case '\f':
+      linefeed();
+      break;
+    case '\r':
+      x = wrap_pending = 0;
+      break;
+    case 030:
+    case 032:
+      state = GROUND;
+      break;
+    case ESC:
+      state = ESCAPE;
+      private = intermediate = 0;
+      break;
+    }
+}
+
+// Decode UTF-8, with U+FFFD for anything that isn't: overlong forms,
+// surrogates, and values past U+10FFFF too, which character couldn't
+// write back as UTF-8.
+static void text_byte (unsigned char c)
+{
+  if (more > 0)
+    {
+      if ((c & 0xc0) == 0x80)
+	{
+	  code = code << 6 | (c & 0x3f);
+	  if (--more > 0)
+	    return;
+	  if (code < least || (code >= 0xd800 && code <= 0xdfff)
+	      || code > 0x10ffff)
+	    code = 0xfffd;
+	  put_char(code);
+	  return;
+	}
+      more = 0;
+      put_char(0xfffd);
+    }
+
+  if (c < 0x80)
+    put_char(c);
+  else if ((c & 0xe0) == 0xc0)
+    code = c & 0x1f, more = 1, least = 0x80;
+  else if ((c & 0xf0) == 0xe0)
+    code = c & 0x0f, more = 2, least = 0x800;
+  else if ((c & 0xf8) == 0xf0)
+    code = c & 0x07, more = 3, least = 0x10000;
+  else
+    put_char(0xfffd);
+}
+
+void screen_feed (const char *data, size_t n)
+{
+  const unsigned char *p = (const unsigned char *)data;
+  const unsigned char *end = p + n;
+  unsigned char c;
+
+  if (grid == NULL)
+    return;
+  take_size();
+
+  for (; p < end; p++)
+    {
+      c = *p;
+      switch (state)
+	{
+	case GROUND:
+	  if (c < 0x20 || c == 0x7f)
+	    {
+	      if (more > 0)
+		{
+		  more = 0;
+		  put_char(0xfffd);
+		}
+	      control(c);
+	    }
+	  else
+	    text_byte(c);
+	  break;
+
+	case ESCAPE:
+	  if (c == '[')
+	    {
+	      state = CSI;
+	      nparams = 0;
+	      params[0] = 0;
+	    }
+	  else if (c == ']' || c == 'P' || c == 'X' || c == '^' || c == '_')
+	    state = STRING;
+	  else if (c >= 0x20 && c < 0x30)
+	    state = ESCAPE_SKIP;
+	  else if (c < 0x20)
+	    control(c);
+	  else
+	    {
+	      state = GROUND;
+	      escape(c);
+	    }
+	  break;
+
+	case ESCAPE_SKIP:
+	  // A character set designation, or another sequence with an
+	  // intermediate byte.
+	  if (c < 0x20)
+	    control(c);
+	  else if (c >= 0x30)
+	    state = GROUND;
+	  break;
+
+	case CSI:
+	  if (c >= '0' && c <= '9')
+	    {
+	      if (nparams == 0)
+		nparams = 1;
+	      if (params[nparams - 1] < 10000)
+		params[nparams - 1] = params[nparams - 1] * 10 + c - '0';
+	    }
+	  else if (c == ';' || c == ':')
+	    {
+	      if (nparams == 0)
+		nparams = 1;
+	      if (nparams < MAX_PARAMS)
+		params[nparams++] = 0;
+	    }
+	  else if (c >= '<' && c <= '?')
+	    private = c;
+	  else if (c >= 0x20 && c < 0x30)
+	    intermediate = c;
+	  else if (c >= 0x40 && c < 0x7f)
+	    {
+	      state = GROUND;
+	      csi(c);
+	    }
+	  else if (c < 0x20)
+	    control(c);
+	  break;
+
+	case STRING:
+	  if (c == 007)
+	    state = GROUND;
+	  else if (c == ESC)
+	    state = STRING_ESCAPE;
+	  break;
+
+	case STRING_ESCAPE:
+	  state = c == '\\' ? GROUND : STRING;
+	  break;
+	}
+    }
+}
+
+static char *color (char *p, int base, int bright, int extended, uint8_t c)
+{
+  if (c < 8)
+    return p + sprintf(p, ";%d", base + c);
+  if (c < 16)
+    return p + sprintf(p, ";%d", bright + c - 8);
+  return p + sprintf(p, ";%d;5;%d", extended, c);
+}
+
+// SGR to go from the default to this cell's attributes, escaped for
+// JSON.
+static char *style (char *p, const struct cell *c)
+{
+  static const uint16_t bits[8] =
+    { A_BOLD, A_DIM, A_ITALIC, A_UNDERLINE, A_BLINK, A_INVERSE, A_HIDDEN,
+      A_STRIKE };
+  static const char codes[8] = "12345789";
+  int i;
+
+  p += sprintf(p, "\\u001b[0");
+  for (i = 0; i < 8; i++)
+    if (c->attr & bits[i])
+      {
+	*p++ = ';';
+	*p++ = codes[i];
+      }
+  if (c->attr & A_FG)
+    p = color(p, 30, 90, 38, c->fg);
+  if (c->attr & A_BG)
+    p = color(p, 40, 100, 48, c->bg);
+  *p++ = 'm';
+  return p;
+}
+
+static char *character (char *p, uint32_t ch)
+{
+  if (ch == '"' || ch == '\\')
+    {
+      *p++ = '\\';
+      *p++ = ch;
+    }
+  else if (ch < 0x20 || ch == 0x7f)
+    p += sprintf(p, "\\u%04x", ch);
+  else if (ch < 0x80)
+    *p++ = ch;
+  else if (ch < 0x800)
+    {
+      *p++ = 0xc0 | ch >> 6;
+      *p++ = 0x80 | (ch & 0x3f);
+    }
+  else if (ch < 0x10000)
+    {
+      *p++ = 0xe0 | ch >> 12;
+      *p++ = 0x80 | (ch >> 6 & 0x3f);
+      *p++ = 0x80 | (ch & 0x3f);
+    }
+  else
+    {
+      *p++ = 0xf0 | ch >> 18;
+      *p++ = 0x80 | (ch >> 12 & 0x3f);
+      *p++ = 0x80 | (ch >> 6 & 0x3f);
+      *p++ = 0x80 | (ch & 0x3f);
+    }
+  return p;
+}
+
+// A row as text, with SGR sequences where the attributes change and
+// no trailing blanks.
+static void encode (int row)
+{
+  const struct cell *c = grid + row * cols;
+  char *p = text[row];
+  uint16_t attr = 0;
+  uint8_t fg = 0, bg = 0;
+  int i, n = cols;
+
+  while (n > 0 && c[n - 1].ch == ' ' && c[n - 1].attr == 0)
+    n--;
+
+  for (i = 0; i < n; i++)
+    {
+      if (c[i].attr != attr || c[i].fg != fg || c[i].bg != bg)
+	{
+	  p = style(p, c + i);
+	  attr = c[i].attr;
+	  fg = c[i].fg;
+	  bg = c[i].bg;
+	}
+      p = character(p, c[i].ch);
+    }
+  if (attr != 0)
+    p += sprintf(p, "\\u001b[m");
+
+  length[row] = p - text[row];
+}
+
+void screen_write (void)
+{
+  struct stat st;
+  const char *separator = "";
+  int row, all;
+  FILE *f;
+
+  if (config.screen == NULL || grid == NULL)
+    return;
+  take_size();
+
+  f = fopen(config.screen, "a");
+  if (f == NULL)
+    return;
+
+  // A new file, or one emptied to ask for it, gets the whole screen.
+  all = whole || (fstat(fileno(f), &st) == 0 && st.st_size == 0);
+  whole = 0;
+
+  fprintf(f, "{\"cols\": %d, \"rows\": %d, \"cursor\": [%d, %d], "
+	  "\"cursor_visible\": %s, \"full\": %s, \"lines\": {",
+	  cols, rows, y, x, cursor_visible ? "true" : "false",
+	  all ? "true" : "false");
+  for (row = 0; row < rows; row++)
+    {
+      if (dirty[row / 64] & 1ULL << (row % 64))
+	encode(row);
+      else if (!all)
+	continue;
+      fprintf(f, "%s\"%d\": \"", separator, row);
+      fwrite(text[row], 1, length[row], f);
+      fputc('"', f);
+      separator = ", ";
+    }
+  fputs("}}\n", f);
+  fclose(f);
+
+  memset(dirty, 0, (rows + 63) / 64 * sizeof *dirty);
+}
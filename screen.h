@@ -0,0 +1,26 @@
+/*
+ * A model of the terminal screen the program draws on, so the current
+ * screen can be reported instead of the bytes that made it.
+ */
+
+#ifndef SCREEN_H
+#define SCREEN_H
+
+#include <stddef.h>
+
+// Reports go to config.screen.
+extern int screen_active (void);
+
+// Start with the size of the pty, or change it.  The change may come
+// from any thread, and is made before the next feed or report.
+extern void screen_start (int fdm);
+extern void screen_resize (int cols, int rows);
+
+// Interpret output from the program.
+extern void screen_feed (const char *data, size_t n);
+
+// Append the rows changed since the last report to the file, or all
+// of them if it's empty, as a line of JSON.
+extern void screen_write (void);
+
+#endif
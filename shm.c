@@ -0,0 +1,207 @@
+/*
+ * Shared memory ring transport, and a consumer for it.  Publishing is
+ * a store to head and a load of waiting, so the system call to wake
+ * the consumer is only made when it's asleep.  The consumer reads with
+ * no system calls at all while there's output.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#include "pty-stdio.h"
+#include "shm.h"
+
+static struct shm_ring *shm;
+static struct ring *published;
+
+static void wake (struct shm_ring *s)
+{
+  __atomic_add_fetch(&s->event, 1, __ATOMIC_SEQ_CST);
+#ifdef __linux__
+  syscall(SYS_futex, &s->event, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif
+}
+
+// Sleep until event changes from the value seen, or at most a second.
+static void sleep_on (struct shm_ring *s, uint32_t seen)
+{
+  struct timespec ts = { 1, 0 };
+
+#ifdef __linux__
+  syscall(SYS_futex, &s->event, FUTEX_WAIT, seen, &ts, NULL, 0);
+#else
+  ts.tv_sec = 0;
+  ts.tv_nsec = 1000000;
+  nanosleep(&ts, NULL);
+#endif
+}
+
+void shm_publish (struct shm_ring *s, struct ring *r)
+{
+  if (s->head == r->head)
+    return;
+
+  // Ordered before the load of waiting, which the consumer sets
+  // before its last look at head.
+  __atomic_store_n(&s->head, r->head, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&s->waiting, __ATOMIC_SEQ_CST))
+    wake(s);
+}
+
+void shm_sync (struct shm_ring *s, struct ring *r)
+{
+  r->tail = __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE);
+}
+
+static void shm_close (void)
+{
+  shm_publish(shm, published);
+  __atomic_store_n(&shm->closed, 1, __ATOMIC_SEQ_CST);
+  wake(shm);
+}
+
+struct shm_ring *shm_create (const char *name, size_t size, struct ring *r)
+{
+  size_t length = sizeof (struct shm_ring) + size;
+  int fd;
+
+  fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1)
+    fatal("Error %d on shm_open %s", errno, name);
+  if (ftruncate(fd, length) == -1)
+    fatal("Error %d on ftruncate %s", errno, name);
+  shm = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (shm == MAP_FAILED)
+    fatal("Error %d on mmap %s", errno, name);
+  close(fd);
+
+  // The magic goes in last, so a consumer that finds it finds the
+  // rest as well.
+  shm->size = size;
+  shm->pid = getpid();
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(shm->magic, SHM_MAGIC, sizeof shm->magic);
+
+  free(r->data);
+  r->data = shm->data;
+  r->size = size;
+  r->head = r->tail = 0;
+
+  published = r;
+  atexit(shm_close);
+  return shm;
+}
+
+static void write_all (const char *data, size_t n)
+{
+  ssize_t rc;
+
+  while (n > 0)
+    {
+      rc = write(1, data, n);
+      if (rc < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  fatal("Error %d on write standard output", errno);
+	}
+      data += rc;
+      n -= rc;
+    }
+}
+
+// Map the ring once pty-stdio has made it.
+static struct shm_ring *attach (const char *name)
+{
+  struct timespec pause = { 0, 10000000 };
+  struct shm_ring *s;
+  struct stat st;
+  int fd;
+
+  for (;;)
+    {
+      fd = shm_open(name, O_RDWR, 0);
+      if (fd == -1 && errno != ENOENT)
+	fatal("Error %d on shm_open %s", errno, name);
+      if (fd != -1)
+	{
+	  if (fstat(fd, &st) == -1)
+	    fatal("Error %d on fstat %s", errno, name);
+	  if ((size_t)st.st_size > sizeof *s)
+	    break;
+	  close(fd);
+	}
+      nanosleep(&pause, NULL);
+    }
+
+  s = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (s == MAP_FAILED)
+    fatal("Error %d on mmap %s", errno, name);
+  close(fd);
+
+  while (memcmp(s->magic, SHM_MAGIC, sizeof s->magic) != 0)
+    nanosleep(&pause, NULL);
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (sizeof *s + s->size > (size_t)st.st_size)
+    fatal("Invalid shared memory ring: %s", name);
+
+  return s;
+}
+
+void shm_cat (const char *name)
+{
+  struct shm_ring *s = attach(name);
+  uint64_t head, tail = s->tail;
+  uint32_t seen;
+  size_t offset, n;
+
+  for (;;)
+    {
+      head = __atomic_load_n(&s->head, __ATOMIC_ACQUIRE);
+      if (head != tail)
+	{
+	  offset = tail % s->size;
+	  n = head - tail < s->size - offset ? head - tail : s->size - offset;
+	  write_all(s->data + offset, n);
+	  tail += n;
+	  __atomic_store_n(&s->tail, tail, __ATOMIC_RELEASE);
+	  continue;
+	}
+
+      // Everything is published before closed is set.
+      if (__atomic_load_n(&s->closed, __ATOMIC_ACQUIRE))
+	{
+	  if (__atomic_load_n(&s->head, __ATOMIC_ACQUIRE) == tail)
+	    break;
+	  continue;
+	}
+
+      __atomic_store_n(&s->waiting, 1, __ATOMIC_SEQ_CST);
+      seen = __atomic_load_n(&s->event, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&s->head, __ATOMIC_SEQ_CST) == tail
+	  && !__atomic_load_n(&s->closed, __ATOMIC_SEQ_CST))
+	{
+	  sleep_on(s, seen);
+
+	  // Killed before it could close the ring.
+	  if (kill(s->pid, 0) == -1 && errno == ESRCH
+	      && __atomic_load_n(&s->head, __ATOMIC_ACQUIRE) == tail)
+	    break;
+	}
+      __atomic_store_n(&s->waiting, 0, __ATOMIC_SEQ_CST);
+    }
+
+  shm_unlink(name);
+  exit(0);
+}
@@ -0,0 +1,64 @@
+/*
+ * Shared memory ring for the program's output.
+ *
+ * With --shm=NAME, pty-stdio creates the POSIX shared memory object
+ * NAME holding a struct shm_ring, and reads the program's output
+ * straight into its data.  There is one producer, pty-stdio, and one
+ * consumer.  Both counters only grow, and byte N of the output is at
+ * data[N % size]:
+ *
+ *   head     bytes published, advanced by pty-stdio with release
+ *            semantics after the data is in place.
+ *   tail     bytes consumed, advanced by the consumer with release
+ *            semantics once it's done with the data.
+ *
+ * A consumer with nothing to read sets waiting, reads event, checks
+ * head once more, and then sleeps on event as a futex.  pty-stdio adds
+ * to event and wakes it after publishing if waiting is set.  When the
+ * program exits, closed is set.  pty-stdio waits for the consumer
+ * while the ring is full, so no output is lost, and leaves the object
+ * for the consumer to unlink.
+ */
+
+#ifndef SHM_H
+#define SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "ring.h"
+
+#define SHM_MAGIC "PTYSHM\0\1"
+
+// How often to look for room while the ring is full.
+#define SHM_POLL_USEC 1000
+
+struct shm_ring
+{
+  char magic[8];
+  uint64_t size;
+  uint32_t pid;         // Of pty-stdio, to notice if it's gone.
+
+  // Written by pty-stdio.
+  uint64_t head __attribute__ ((aligned (64)));
+  uint32_t event;
+  uint32_t closed;
+
+  // Written by the consumer.
+  uint64_t tail __attribute__ ((aligned (64)));
+  uint32_t waiting;
+
+  char data[] __attribute__ ((aligned (64)));
+};
+
+// Create the ring, and make r use its data.
+extern struct shm_ring *shm_create (const char *name, size_t size,
+				    struct ring *r);
+
+// Publish what's been put in r, and take back what was consumed.
+extern void shm_publish (struct shm_ring *, struct ring *r);
+extern void shm_sync (struct shm_ring *, struct ring *r);
+
+// Copy the ring NAME to standard output until it's closed.
+extern void shm_cat (const char *name);
+
+#endif
@@ -0,0 +1,220 @@
+/*
+ * The output stages, each a few lines around the module that does the
+ * work.
+ */
+
+#include <stdlib.h>
+#include "pty-stdio.h"
+#include "stage.h"
+#include "record.h"
+#include "expect.h"
+#include "screen.h"
+#include "filter.h"
+#include "lines.h"
+#include "net.h"
+#include "compress.h"
+#include "tail.h"
+
+static void (*respond) (const char *, size_t);
+static struct ring *ring;
+static char *prefixed;   // Lines go here with their prefixes.
+
+static int record_stage_active (void)
+{
+  return config.record != NULL;
+}
+
+static void record_stage_init (int fdm)
+{
+  record_open(config.record);
+}
+
+static size_t record_process (char **data, size_t n)
+{
+  record_data(*data, n);
+  return n;
+}
+
+static void expect_stage_init (int fdm)
+{
+  expect_init(config.expect);
+}
+
+static size_t expect_process (char **data, size_t n)
+{
+  expect_scan(*data, n, respond);
+  return n;
+}
+
+static size_t screen_process (char **data, size_t n)
+{
+  screen_feed(*data, n);
+  return n;
+}
+
+static void tail_stage_init (int fdm)
+{
+  tail_init(config.tail, config.tail_size);
+}
+
+static size_t tail_process (char **data, size_t n)
+{
+  tail_append(*data, n);
+  return n;
+}
+
+// The filter may add a sequence it held from the last chunk, in the
+// room in front.
+static size_t filter_process (char **data, size_t n)
+{
+  *data -= FILTER_ROOM;
+  return filter_apply(*data, n);
+}
+
+static size_t filter_most (size_t n)
+{
+  return n + FILTER_ROOM;
+}
+
+static size_t filter_fits (size_t n)
+{
+  return n > FILTER_ROOM ? n - FILTER_ROOM : 0;
+}
+
+static void lines_stage_init (int fdm)
+{
+  lines_init();
+  prefixed = malloc(lines_room(FILTER_ROOM + config.buffer_size));
+  if (prefixed == NULL)
+    fatal("Out of memory");
+}
+
+static size_t lines_process (char **data, size_t n)
+{
+  n = lines_apply(prefixed, *data, n);
+  *data = prefixed;
+  return n;
+}
+
+static size_t lines_fits (size_t n)
+{
+  return n / lines_room(1);
+}
+
+static size_t save_process (char **data, size_t n)
+{
+  net_save(*data, n);
+  return n;
+}
+
+static size_t compress_process (char **data, size_t n)
+{
+  compress_put(ring, *data, n);
+  return 0;
+}
+
+static void compress_stage_flush (void)
+{
+  compress_flush(ring);
+}
+
+static void compress_stage_close (void)
+{
+  compress_end(ring);
+}
+
+// In the order they run.  Those that look at what the program wrote
+// come first.
+static const struct stage stages[] =
+{
+  { "record", record_stage_active, record_stage_init, record_process,
+    NULL, NULL, NULL, NULL, 0, 0 },
+  { "expect", expect_active, expect_stage_init, expect_process,
+    NULL, NULL, NULL, NULL, 0, 0 },
+  { "screen", screen_active, screen_start, screen_process,
+    NULL, NULL, NULL, NULL, 0, 0 },
+  { "tail", tail_active, tail_stage_init, tail_process,
+    NULL, NULL, NULL, NULL, 0, 0 },
+  { "filter", filter_active, NULL, filter_process,
+    filter_most, filter_fits, NULL, NULL, 1, FILTER_ROOM },
+  { "lines", lines_active, lines_stage_init, lines_process,
+    lines_room, lines_fits, NULL, NULL, 1, 0 },
+  { "scrollback", net_active, NULL, save_process,
+    NULL, NULL, NULL, NULL, 0, 0 },
+  { "compress", compress_active, NULL, compress_process,
+    NULL, compress_room, compress_stage_flush, compress_stage_close, 1, 0 },
+};
+
+#define N_STAGES (sizeof stages / sizeof stages[0])
+
+void chain_output (struct chain *c, int fdm, struct ring *r,
+		   void (*to_program) (const char *, size_t))
+{
+  static int started;
+  const struct stage *s;
+
+  c->n = c->transforms = 0;
+  c->headroom = 0;
+  ring = r;
+  respond = to_program;
+
+  // An engine that can't do the job hands over to the next, which
+  // asks again.
+  for (s = stages; s < stages + N_STAGES; s++)
+    if (s->active())
+      {
+	if (!started && s->init != NULL)
+	  s->init(fdm);
+	c->stages[c->n++] = s;
+	c->transforms += s->transforms;
+	c->headroom += s->headroom;
+      }
+  started = 1;
+}
+
+size_t chain_process (struct chain *c, char **data, size_t n)
+{
+  int i;
+
+  for (i = 0; i < c->n && n > 0; i++)
+    n = c->stages[i]->process(data, n);
+  return n;
+}
+
+size_t chain_most (struct chain *c, size_t n)
+{
+  int i;
+
+  for (i = 0; i < c->n; i++)
+    if (c->stages[i]->most != NULL)
+      n = c->stages[i]->most(n);
+  return n;
+}
+
+size_t chain_fits (struct chain *c, size_t n)
+{
+  int i;
+
+  for (i = c->n - 1; i >= 0; i--)
+    if (c->stages[i]->fits != NULL)
+      n = c->stages[i]->fits(n);
+  return n;
+}
+
+void chain_flush (struct chain *c)
+{
+  int i;
+
+  for (i = 0; i < c->n; i++)
+    if (c->stages[i]->flush != NULL)
+      c->stages[i]->flush();
+}
+
+void chain_close (struct chain *c)
+{
+  int i;
+
+  for (i = 0; i < c->n; i++)
+    if (c->stages[i]->close != NULL)
+      c->stages[i]->close();
+}
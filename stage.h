@@ -0,0 +1,68 @@
+/*
+ * Stages the program's output goes through between the pty and the
+ * ring, run one after the other on each chunk in a single pass: the
+ * recorder, triggers, the screen model, the tail kept in memory, the
+ * escape sequence filter, line prefixes, the scrollback for
+ * connections, and the compressor.
+ */
+
+#ifndef STAGE_H
+#define STAGE_H
+
+#include <stddef.h>
+#include "ring.h"
+
+struct stage
+{
+  const char *name;
+
+  // Whether the command line asks for it, and what to set up before
+  // the first chunk, with the master pty.  init may be NULL.
+  int (*active) (void);
+  void (*init) (int fdm);
+
+  // Work on n bytes at *data.  A stage that changes them leaves *data
+  // pointing at the result, in the room in front of the data or in a
+  // buffer of its own, and returns its length.  A stage that takes
+  // them into the ring returns 0.  The rest just look and return n.
+  size_t (*process) (char **data, size_t n);
+
+  // The most output from n bytes, and the most input that can't
+  // make more than n.  NULL for stages that don't change the size.
+  size_t (*most) (size_t n);
+  size_t (*fits) (size_t n);
+
+  // No more input for now, and no more at all.  May be NULL.
+  void (*flush) (void);
+  void (*close) (void);
+
+  int transforms;   // Changes the data.
+  size_t headroom;  // Room process needs in front of the data.
+};
+
+#define MAX_STAGES 8
+
+struct chain
+{
+  const struct stage *stages[MAX_STAGES];
+  int n;
+  int transforms;   // Stages that change the data.
+  size_t headroom;  // Room process needs in front of the data.
+};
+
+// The stages the command line asks for, set up the first time.
+// Compressed output goes in the ring, and responses to triggers go to
+// respond.
+extern void chain_output (struct chain *, int fdm, struct ring *,
+			  void (*respond) (const char *, size_t));
+
+// Run the data through every stage.  Returns what's left for the
+// ring, at *data.
+extern size_t chain_process (struct chain *, char **data, size_t n);
+
+extern size_t chain_most (struct chain *, size_t n);
+extern size_t chain_fits (struct chain *, size_t n);
+extern void chain_flush (struct chain *);
+extern void chain_close (struct chain *);
+
+#endif
@@ -0,0 +1,75 @@
+/*
+ * Relay statistics, written as one line of JSON per report.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include "pty-stdio.h"
+#include "stats.h"
+#include "screen.h"
+
+struct stats stats;
+volatile sig_atomic_t stats_requested;
+
+static void handler (int sig)
+{
+  stats_requested = 1;
+}
+
+static void counters (FILE *f, const char *name, const struct counters *c)
+{
+  long long blocked = c->blocked_usec, throttled = c->throttled_usec;
+
+  // Count a block still going on.
+  if (c->blocked_since)
+    blocked += monotonic_usec() - c->blocked_since;
+  if (c->throttled_since)
+    throttled += monotonic_usec() - c->throttled_since;
+
+  fprintf(f, "\"%s\": {\"bytes\": %llu, \"reads\": %llu, \"writes\": %llu, "
+	  "\"short_writes\": %llu, \"max_buffered\": %zu, "
+	  "\"blocked_usec\": %lld, \"throttled_usec\": %lld}",
+	  name, c->bytes, c->reads, c->writes, c->short_writes,
+	  c->max_buffered, blocked, throttled);
+}
+
+// Append a report to the statistics file, and the screen to its own.
+void stats_write (void)
+{
+  FILE *f;
+
+  screen_write();
+  if (config.stats == NULL)
+    return;
+
+  f = fopen(config.stats, "a");
+  if (f == NULL)
+    return;
+
+  fprintf(f, "{\"engine\": \"%s\", \"wakeups\": %llu, ",
+	  stats.engine ? stats.engine : "", stats.wakeups);
+  counters(f, "input", &stats.input);
+  fputs(", ", f);
+  counters(f, "output", &stats.output);
+  fputs("}\n", f);
+  fclose(f);
+}
+
+// Report on SIGUSR1 and at exit.  The signal must interrupt the engine
+// wait, so the loop gets to write the report.
+void stats_init (void)
+{
+  struct sigaction sa;
+
+  if (config.stats == NULL && !screen_active())
+    return;
+
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = handler;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+
+  atexit(stats_write);
+}
@@ -0,0 +1,55 @@
+/*
+ * Counters kept by the relay loops, cheap enough to be always on.
+ * With --stats=FILE they are written out on SIGUSR1 and at exit, as
+ * is the screen with --screen=FILE.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <signal.h>
+
+// One direction, toward the program or toward standard output.
+struct counters
+{
+  unsigned long long bytes;         // Written to the output.
+  unsigned long long reads;         // Calls, including EAGAIN.
+  unsigned long long writes;
+  unsigned long long short_writes;  // Wrote less than was pending.
+  size_t max_buffered;
+  long long blocked_usec;           // Output full, waiting for room.
+  long long blocked_since;
+  long long throttled_usec;         // Input held back by --max-rate.
+  long long throttled_since;
+};
+
+struct stats
+{
+  struct counters input, output;
+  unsigned long long wakeups;       // Returns from the engine wait.
+  const char *engine;
+};
+
+extern struct stats stats;
+extern volatile sig_atomic_t stats_requested;
+
+extern void stats_init (void);
+extern void stats_write (void);
+
+static inline void stats_buffered (struct counters *c, size_t n)
+{
+  if (n > c->max_buffered)
+    c->max_buffered = n;
+}
+
+// Write the counters if SIGUSR1 asked for them.
+static inline void stats_check (void)
+{
+  if (stats_requested)
+    {
+      stats_requested = 0;
+      stats_write();
+    }
+}
+
+#endif
@@ -0,0 +1,136 @@
+/*
+ * Output tail.  The ring is a memory file mapped twice, back to back,
+ * so whatever the head, the last size bytes are one span of memory:
+ * appending is one memcpy and dumping is one write, straight from the
+ * mapping.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "pty-stdio.h"
+#include "tail.h"
+
+static const char *file;
+static char *data;
+static size_t size;
+static uint64_t head;   // All the bytes ever appended.
+
+static void handler (int sig)
+{
+  int saved = errno;
+
+  tail_dump();
+  errno = saved;
+}
+
+// A file in memory only.
+static int memory_file (void)
+{
+  char name[64];
+  int fd;
+
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+  fd = memfd_create("pty-stdio-tail", MFD_CLOEXEC);
+  if (fd != -1)
+    return fd;
+#endif
+
+  snprintf(name, sizeof name, "/pty-stdio-tail-%d", (int)getpid());
+  fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd == -1)
+    fatal("Error %d on shm_open %s", errno, name);
+  shm_unlink(name);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
+}
+
+void tail_init (const char *name, size_t n)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+  struct sigaction sa;
+  char *p;
+  int fd;
+
+  file = name;
+  size = (n + page - 1) / page * page;
+
+  fd = memory_file();
+  if (ftruncate(fd, size) == -1)
+    fatal("Error %d on ftruncate()", errno);
+
+  // Reserve room for both, then put the file in each half.
+  data = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (data == MAP_FAILED)
+    fatal("Error %d on mmap()", errno);
+  p = mmap(data, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+  if (p == MAP_FAILED)
+    fatal("Error %d on mmap()", errno);
+  p = mmap(data + size, size, PROT_READ | PROT_WRITE,
+	   MAP_SHARED | MAP_FIXED, fd, 0);
+  if (p == MAP_FAILED)
+    fatal("Error %d on mmap()", errno);
+  close(fd);
+
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = handler;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR2, &sa, NULL);
+}
+
+int tail_active (void)
+{
+  return config.tail != NULL;
+}
+
+void tail_append (const char *p, size_t n)
+{
+  // Only the end of a large append is kept.
+  if (n > size)
+    {
+      p += n - size;
+      head += n - size;
+      n = size;
+    }
+
+  memcpy(data + head % size, p, n);
+  __atomic_store_n(&head, head + n, __ATOMIC_RELEASE);
+}
+
+void tail_dump (void)
+{
+  uint64_t end;
+  const char *p;
+  size_t n;
+  ssize_t rc;
+  int fd;
+
+  if (data == NULL)
+    return;
+
+  end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+  n = end < size ? end : size;
+  p = data + (end - n) % size;
+
+  fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1)
+    return;
+  while (n > 0)
+    {
+      rc = write(fd, p, n);
+      if (rc < 0 && errno == EINTR)
+	continue;
+      if (rc <= 0)
+	break;
+      p += rc;
+      n -= rc;
+    }
+  close(fd);
+}
@@ -0,0 +1,21 @@
+/*
+ * The last of the program's output, kept in memory to be written out
+ * when something goes wrong.
+ */
+
+#ifndef TAIL_H
+#define TAIL_H
+
+#include <stddef.h>
+
+// Keep the last size bytes of output, to be written to file on
+// SIGUSR2 and on failure.
+extern void tail_init (const char *file, size_t size);
+extern int tail_active (void);
+
+extern void tail_append (const char *data, size_t n);
+
+// Replace the file with what's kept.  Safe in a signal handler.
+extern void tail_dump (void);
+
+#endif
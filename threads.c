@@ -0,0 +1,467 @@
+/*
+ * Relay with a thread for each direction, so keystrokes reach the
+ * program however slowly standard output drains.
+ *
+ * Standard input is copied to the pty by a thread of its own.  Output
+ * goes through a pipeline of threads: one reads the pty, a worker runs
+ * recording, triggers, the screen model, and the filter if any of them
+ * is on, and the main thread writes to standard output.  The stages
+ * hand over buffers from the pool through single producer, single
+ * consumer queues.  Without the filter, the worker only looks at the
+ * data, so it gets each buffer at the same time as the writer, and
+ * the buffer is free when both are done with it.  A stage only makes
+ * a system call to hand over when the next one is asleep waiting.
+ *
+ * There's no event engine: each thread waits in its own read, write,
+ * or poll.  Responses to triggers go through a pipe to the thread that
+ * writes the pty.  Signals go to the thread that sees the output
+ * first, which also writes reports.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#include "pty-stdio.h"
+#include "relay.h"
+#include "stats.h"
+#include "stage.h"
+#include "lines.h"
+#include "compress.h"
+#include "net.h"
+#include "resize.h"
+#include "child.h"
+#include "buffers.h"
+#include "interrupt.h"
+#include "rate.h"
+
+// The end of the output, in place of a buffer.
+#define END UINT32_MAX
+
+struct item
+{
+  unsigned index, offset, length;
+};
+
+struct queue
+{
+  uint32_t head __attribute__ ((aligned (64)));  // Next to take.
+  uint32_t tail __attribute__ ((aligned (64)));  // Next to put.
+  uint32_t waiting;
+  struct item *slots;  // As many as there are buffers, so a push
+  unsigned size;       // never waits.
+};
+
+static struct queue work, out;
+static int program_fd;
+static struct chain chain;
+static int working;    // The worker stage is running,
+static int parallel;   // alongside the writer.
+static pthread_t worker;
+
+static void push (struct queue *q, struct item item)
+{
+  q->slots[q->tail % q->size] = item;
+
+  // Ordered before the load of waiting, which the consumer sets
+  // before its last look at tail.
+  __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&q->waiting, __ATOMIC_SEQ_CST))
+    {
+#ifdef __linux__
+      syscall(SYS_futex, &q->tail, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+    }
+}
+
+// Take the next item, waiting for one.  Reports asked for with a
+// signal are written by the thread that gets signals.
+static struct item pop (struct queue *q, int signals)
+{
+  struct item item;
+#ifndef __linux__
+  struct timespec pause = { 0, 100000 };
+#endif
+
+  while (__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == q->head)
+    {
+      __atomic_store_n(&q->waiting, 1, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&q->tail, __ATOMIC_SEQ_CST) == q->head)
+	{
+#ifdef __linux__
+	  syscall(SYS_futex, &q->tail, FUTEX_WAIT_PRIVATE, q->head,
+		  NULL, NULL, 0);
+#else
+	  nanosleep(&pause, NULL);
+#endif
+	}
+      __atomic_store_n(&q->waiting, 0, __ATOMIC_SEQ_CST);
+      if (signals)
+	stats_check();
+    }
+
+  item = q->slots[q->head % q->size];
+  __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+  return item;
+}
+
+// Responses to triggers go to the thread that writes the pty, so they
+// never land in the middle of input.  What doesn't fit in the pipe is
+// dropped, as the event loop drops what doesn't fit in its ring.
+static int responses[2] = { -1, -1 };
+
+static void respond (const char *data, size_t n)
+{
+  ssize_t rc;
+
+  while (n > 0)
+    {
+      rc = write(responses[1], data, n);
+      if (rc < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return;
+	}
+      data += rc;
+      n -= rc;
+    }
+}
+
+// Write it all, waiting for room if the descriptor was left
+// non-blocking.  Returns -1 on error.
+static int write_all (int fd, const char *data, size_t n,
+		      struct counters *count)
+{
+  struct pollfd p = { fd, POLLOUT, 0 };
+  ssize_t rc;
+
+  while (n > 0)
+    {
+      count->writes++;
+      rc = write(fd, data, n);
+      if (rc < 0)
+	{
+	  if (errno == EAGAIN || errno == EWOULDBLOCK)
+	    poll(&p, 1, -1);
+	  else if (errno != EINTR)
+	    return -1;
+	  continue;
+	}
+      if ((size_t)rc < n)
+	count->short_writes++;
+      count->bytes += rc;
+      data += rc;
+      n -= rc;
+    }
+  return 0;
+}
+
+// Write to the pty.  Returns 0 once the program is gone.
+static int to_pty (const char *data, size_t n)
+{
+  if (write_all(program_fd, data, n, &stats.input) == 0)
+    return 1;
+  if (errno != EIO)
+    fatal("Error %d on write master pty", errno);
+  return 0;
+}
+
+// Standard input to the pty, and responses to triggers.  Window size
+// changes come here too.
+static void *to_program (void *arg)
+{
+  struct pollfd p[3] = { { 0, POLLIN, 0 }, { resize_fd(), POLLIN, 0 },
+			 { responses[0], POLLIN, 0 } };
+  char *buffer, *data;
+  ssize_t rc;
+  size_t skip;
+
+  buffer = malloc(config.buffer_size);
+  if (buffer == NULL)
+    fatal("Out of memory");
+
+  for (;;)
+    {
+      if (p[1].fd != -1 || p[2].fd != -1)
+	{
+	  if (poll(p, 3, -1) == -1)
+	    continue;
+	  if (p[1].revents & POLLIN)
+	    resize_apply();
+	  if (p[2].revents & POLLIN)
+	    {
+	      rc = read(responses[0], buffer, config.buffer_size);
+	      if (rc > 0 && !to_pty(buffer, rc))
+		return NULL;
+	    }
+	  if (p[0].revents == 0)
+	    continue;
+	}
+
+      stats.input.reads++;
+      rc = read(0, buffer, config.buffer_size);
+      if (rc < 0 && (errno == EINTR || errno == EAGAIN))
+	{
+	  if (errno == EAGAIN)
+	    poll(p, 1, -1);
+	  continue;
+	}
+      if (rc < 0)
+	fatal("Error %d on read standard input", errno);
+
+      // Keep passing on responses and size changes, if there are any.
+      if (rc == 0)
+	{
+	  p[0].fd = -1;
+	  if (p[1].fd == -1 && p[2].fd == -1)
+	    return NULL;
+	  continue;
+	}
+
+      // The interrupt goes first, and the input before it nowhere.
+      data = buffer;
+      if (config.interrupt
+	  && (skip = interrupt_find(program_fd, buffer, rc)) > 0)
+	{
+	  interrupt_send(program_fd);
+	  data += skip;
+	  rc -= skip;
+	}
+
+      // The program is gone, the output side finishes up.
+      if (!to_pty(data, rc))
+	return NULL;
+    }
+}
+
+// Sleep until the rate limit allows a read, and return how much.
+static size_t allowed (void)
+{
+  struct timespec pause;
+  size_t n;
+  long usec;
+
+  if (!rate_active())
+    return config.buffer_size;
+
+  while ((n = rate_allow()) == 0)
+    {
+      usec = rate_wait();
+      pause.tv_sec = usec / 1000000;
+      pause.tv_nsec = usec % 1000000 * 1000;
+      nanosleep(&pause, NULL);
+      if (!working)
+	stats_check();
+    }
+  return n < config.buffer_size ? n : config.buffer_size;
+}
+
+// Read what the program wrote, waiting for it.  Once the program has
+// exited, something else may hold the pty open so there will be no
+// EIO.  As in the event loop, nothing more for a while is the end.
+static ssize_t read_program (char *data, size_t n)
+{
+  static long long exited;
+  struct pollfd p[2] = { { program_fd, POLLIN, 0 }, { -1, POLLIN, 0 } };
+  long long left = -1;
+  ssize_t rc;
+
+  for (;;)
+    {
+      stats.output.reads++;
+      rc = read(program_fd, data, n);
+      if (rc >= 0 || (errno != EAGAIN && errno != EINTR))
+	return rc;
+
+      if (exited)
+	{
+	  left = exited + CHILD_LINGER_USEC - monotonic_usec();
+	  if (left <= 0)
+	    return 0;
+	}
+      p[1].fd = exited ? -1 : child_fd();
+
+      if (errno == EAGAIN)
+	rc = poll(p, 2, left < 0 ? -1 : (left + 999) / 1000);
+      if (rc == -1 && !working)
+	stats_check();
+      if (rc > 0 && (p[1].revents & POLLIN) && child_reap())
+	exited = monotonic_usec();
+    }
+}
+
+// The pty into buffers from the pool.
+static void *from_program (void *arg)
+{
+  struct queue *next = working ? &work : &out;
+  struct item item;
+  ssize_t rc;
+  int b;
+
+  for (;;)
+    {
+      while ((b = buffer_get()) == -1)
+	if (!working)
+	  stats_check();
+      item.index = b;
+      item.offset = chain.headroom;
+
+      rc = read_program(buffer_data(b) + chain.headroom, allowed());
+
+      // The master side reports EIO when the child is gone.
+      if (rc < 0 && errno != EIO)
+	fatal("Error %d on read master pty", errno);
+      if (rc <= 0)
+	{
+	  buffer_hold(b, 1);
+	  buffer_put(b);
+	  item.index = END;
+	  push(next, item);
+	  if (parallel)
+	    push(&out, item);
+	  return NULL;
+	}
+
+      if (rate_active())
+	rate_take(rc);
+      item.length = rc;
+      buffer_hold(b, parallel ? 2 : 1);
+      push(next, item);
+      if (parallel)
+	push(&out, item);
+    }
+}
+
+// What the event loop does between reading and writing.
+static void *process (void *arg)
+{
+  struct item item;
+  char *data;
+
+  for (;;)
+    {
+      item = pop(&work, 1);
+      if (item.index != END)
+	{
+	  data = buffer_data(item.index) + item.offset;
+	  item.length = chain_process(&chain, &data, item.length);
+	  item.offset = data - buffer_data(item.index);
+	}
+      if (parallel && item.index != END)
+	buffer_put(item.index);
+      else if (!parallel)
+	push(&out, item);
+      if (item.index == END)
+	return NULL;
+    }
+}
+
+static pthread_t start (void *(*run) (void *))
+{
+  pthread_t thread;
+  int rc;
+
+  rc = pthread_create(&thread, NULL, run, NULL);
+  if (rc != 0)
+    fatal("Error %d on pthread_create()", rc);
+  return thread;
+}
+
+static void queue_init (struct queue *q, unsigned size)
+{
+  q->slots = malloc(size * sizeof *q->slots);
+  if (q->slots == NULL)
+    fatal("Out of memory");
+  q->size = size;
+}
+
+void threaded_master (int fdm)
+{
+  struct item item;
+  sigset_t signals, old;
+  size_t size;
+  unsigned n;
+
+  // Line prefixes, compression, and the other transports need the
+  // event loop.
+  if (lines_active() || compress_active() || net_active()
+      || config.shm != NULL)
+    return;
+
+  // Reads wait in poll, so they can give up once the program is gone.
+  program_fd = fdm;
+  set_nonblock(fdm);
+  if (config.expect != NULL)
+    {
+      if (pipe(responses) == -1)
+	fatal("Error %d on pipe()", errno);
+      fcntl(responses[0], F_SETFL, O_NONBLOCK);
+      fcntl(responses[1], F_SETFL, O_NONBLOCK);
+    }
+  chain_output(&chain, fdm, NULL, respond);
+  working = chain.n > 0;
+  parallel = working && !chain.transforms;
+  stats.engine = "threads";
+
+  // Enough for reads to go on while the writer has a few buffers.
+  size = chain.headroom + config.buffer_size;
+  n = buffers_init(config.buffer_pool ? config.buffer_pool : 16 * size, size);
+  queue_init(&work, n + 1);
+  queue_init(&out, n + 1);
+
+  // Only the first output stage takes signals, the others have them
+  // blocked from the start.
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  sigaddset(&signals, SIGWINCH);
+  sigaddset(&signals, SIGCHLD);
+  pthread_sigmask(SIG_BLOCK, &signals, &old);
+  pthread_detach(start(to_program));
+  if (working)
+    {
+      pthread_sigmask(SIG_SETMASK, &old, NULL);
+      worker = start(process);
+      pthread_sigmask(SIG_BLOCK, &signals, NULL);
+      pthread_detach(start(from_program));
+    }
+  else
+    {
+      pthread_sigmask(SIG_SETMASK, &old, NULL);
+      pthread_detach(start(from_program));
+      pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    }
+
+  // This thread writes standard output.
+  for (;;)
+    {
+      item = pop(&out, 0);
+      if (item.index == END)
+	{
+	  // The worker may still be recording.
+	  if (working)
+	    pthread_join(worker, NULL);
+	  exit(child_status());
+	}
+
+      if (write_all(1, buffer_data(item.index) + item.offset,
+		    item.length, &stats.output) == -1)
+	{
+	  // Nobody wants the rest, but keep the program going.
+	  if (errno != EPIPE && errno != EIO)
+	    fatal("Error %d on write standard output", errno);
+	}
+      buffer_put(item.index);
+    }
+}
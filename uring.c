@@ -0,0 +1,603 @@
+/*
+ * Relay loop on io_uring, using the raw system calls.
+ *
+ * Reads are multishot into rings of provided buffers, so a read stays
+ * armed and fills buffers as data arrives.  Filled buffers are queued
+ * for writing, gathered into one writev at a time per direction, and
+ * handed back to the kernel when written.  Submissions and waiting
+ * share one io_uring_enter call per batch of completions.
+ *
+ * When buffers run out, the read stops until writes give some back,
+ * which is the backpressure.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "pty-stdio.h"
+#include "relay.h"
+#include "resize.h"
+#include "child.h"
+#include "stage.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+
+#ifndef IORING_OP_READ_MULTISHOT
+#define IORING_OP_READ_MULTISHOT 49
+#endif
+
+#define QUEUE_DEPTH 64
+#define CHUNK_SIZE 4096
+#define MAX_IOV 64
+
+// User data is the stream index times eight plus one of these.
+enum { OP_READ, OP_MULTISHOT, OP_WRITE, OP_HUP, OP_CANCEL, OP_WINCH,
+       OP_CHILD, OP_LINGER };
+
+struct uring
+{
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned tail;  // Local SQ tail, published on submit.
+  int multishot;  // Kernel has multishot reads.
+};
+
+// A filled buffer waiting to be written.
+struct chunk
+{
+  unsigned short bid;
+  unsigned offset, length;
+};
+
+struct stream
+{
+  const char *in_name, *out_name;
+  int in, out;
+  unsigned short group;
+  struct io_uring_buf_ring *bufs;
+  char *data;
+  unsigned count;            // Number of buffers, a power of two.
+  unsigned short buf_tail;
+  struct chunk *queue;       // Count entries, can't overflow.
+  unsigned queue_head, queue_tail;
+  struct iovec iov[MAX_IOV];
+  int reading;               // A read, single or multishot, in flight.
+  int hup;                   // Watching for hangup.
+  int starved;               // Out of buffers until a write completes.
+  int writing;               // Chunks in the writev in flight.
+  int multishot;
+  int eof;
+  size_t queued, want;       // Bytes waiting, and in the writev.
+  struct chain *chain;       // Output stages, which work in place.
+  unsigned headroom;         // Reads land this far in, for them.
+  struct counters *counters;
+};
+
+static struct chain output_chain;
+
+static int sys_setup (unsigned entries, struct io_uring_params *p)
+{
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter (int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+  return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int sys_register (int fd, unsigned op, void *arg, unsigned n)
+{
+  return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+static int supported (struct io_uring_probe *probe, int op)
+{
+  return op <= probe->last_op
+    && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+}
+
+static int uring_init (struct uring *u)
+{
+  struct io_uring_params p;
+  struct io_uring_probe *probe;
+  size_t sq_size, cq_size;
+  char *sq, *cq;
+
+  memset(&p, 0, sizeof p);
+  u->fd = sys_setup(QUEUE_DEPTH, &p);
+  if (u->fd < 0)
+    return -1;
+
+  // Provided buffer rings came after single mmap, so insist on it.
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+    goto fail;
+
+  probe = calloc(1, sizeof *probe + 256 * sizeof probe->ops[0]);
+  if (probe == NULL)
+    fatal("Out of memory");
+  if (sys_register(u->fd, IORING_REGISTER_PROBE, probe, 256) < 0
+      || !supported(probe, IORING_OP_READ)
+      || !supported(probe, IORING_OP_WRITEV))
+    {
+      free(probe);
+      goto fail;
+    }
+  u->multishot = supported(probe, IORING_OP_READ_MULTISHOT);
+  free(probe);
+
+  sq_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  cq_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+  if (cq_size > sq_size)
+    sq_size = cq_size;
+
+  sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED)
+    goto fail;
+  cq = sq;
+
+  u->sqes = mmap(NULL, p.sq_entries * sizeof (struct io_uring_sqe),
+		 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		 u->fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED)
+    goto fail;
+
+  u->sq_head = (unsigned *)(sq + p.sq_off.head);
+  u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  u->sq_array = (unsigned *)(sq + p.sq_off.array);
+  u->cq_head = (unsigned *)(cq + p.cq_off.head);
+  u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  u->tail = *u->sq_tail;
+  return 0;
+
+ fail:
+  close(u->fd);
+  return -1;
+}
+
+static struct io_uring_sqe *get_sqe (struct uring *u)
+{
+  unsigned index = u->tail & *u->sq_mask;
+  struct io_uring_sqe *sqe = &u->sqes[index];
+
+  // Never more requests in flight than the ring holds: a read, a
+  // write, and a poll or cancel per stream, and the polls and timeout
+  // for resizes and the child.
+  memset(sqe, 0, sizeof *sqe);
+  u->sq_array[index] = index;
+  u->tail++;
+  return sqe;
+}
+
+static int submit_and_wait (struct uring *u)
+{
+  unsigned n = u->tail - *u->sq_tail;
+
+  __atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+  return sys_enter(u->fd, n, 1, IORING_ENTER_GETEVENTS);
+}
+
+static void give_buffer (struct stream *s, unsigned short bid)
+{
+  struct io_uring_buf *buf = &s->bufs->bufs[s->buf_tail & (s->count - 1)];
+
+  buf->addr = (unsigned long)(s->data + bid * CHUNK_SIZE + s->headroom);
+  buf->len = CHUNK_SIZE - s->headroom;
+  buf->bid = bid;
+  s->buf_tail++;
+  __atomic_store_n(&s->bufs->tail, s->buf_tail, __ATOMIC_RELEASE);
+}
+
+static int stream_init (struct uring *u, struct stream *s, int group,
+			const char *in_name, int in,
+			const char *out_name, int out)
+{
+  struct io_uring_buf_reg reg;
+  unsigned i;
+
+  s->in_name = in_name;
+  s->out_name = out_name;
+  s->in = in;
+  s->out = out;
+  s->group = group;
+  s->reading = s->hup = s->starved = s->writing = s->eof = 0;
+  s->multishot = u->multishot;
+  s->queue_head = s->queue_tail = 0;
+  s->buf_tail = 0;
+  s->queued = 0;
+  s->counters = out == 1 ? &stats.output : &stats.input;
+  s->chain = out == 1 ? &output_chain : NULL;
+  s->headroom = out == 1 ? output_chain.headroom : 0;
+
+  for (s->count = 2; s->count * CHUNK_SIZE < config.buffer_size
+	 && s->count < 32768; s->count *= 2)
+    ;
+
+  s->bufs = mmap(NULL, s->count * sizeof (struct io_uring_buf),
+		 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  s->data = malloc(s->count * CHUNK_SIZE);
+  s->queue = malloc(s->count * sizeof *s->queue);
+  if (s->bufs == MAP_FAILED || s->data == NULL || s->queue == NULL)
+    fatal("Out of memory");
+
+  memset(&reg, 0, sizeof reg);
+  reg.ring_addr = (unsigned long)s->bufs;
+  reg.ring_entries = s->count;
+  reg.bgid = group;
+  if (sys_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    return -1;
+
+  for (i = 0; i < s->count; i++)
+    give_buffer(s, i);
+
+  return 0;
+}
+
+static void arm_read (struct uring *u, struct stream *s, int index)
+{
+  struct io_uring_sqe *sqe;
+
+  if (s->reading || s->starved || s->eof)
+    return;
+
+  // Multishot reads miss a hangup, so watch for it separately.
+  if (s->multishot && !s->hup)
+    {
+      sqe = get_sqe(u);
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->fd = s->in;
+      sqe->poll32_events = POLLHUP;
+      sqe->user_data = index * 8 + OP_HUP;
+      s->hup = 1;
+    }
+
+  sqe = get_sqe(u);
+  sqe->opcode = s->multishot ? IORING_OP_READ_MULTISHOT : IORING_OP_READ;
+  sqe->fd = s->in;
+  sqe->off = -1;
+  sqe->len = s->multishot ? 0 : CHUNK_SIZE - s->headroom;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = s->group;
+  sqe->user_data = index * 8 + (s->multishot ? OP_MULTISHOT : OP_READ);
+  s->reading = 1;
+}
+
+static void start_write (struct uring *u, struct stream *s, int index)
+{
+  struct io_uring_sqe *sqe;
+  unsigned i;
+  int n = 0;
+
+  if (s->writing)
+    return;
+
+  s->want = 0;
+  for (i = s->queue_head; i != s->queue_tail && n < MAX_IOV; i++, n++)
+    {
+      struct chunk *c = &s->queue[i & (s->count - 1)];
+      s->iov[n].iov_base = s->data + c->bid * CHUNK_SIZE + c->offset;
+      s->iov[n].iov_len = c->length - c->offset;
+      s->want += s->iov[n].iov_len;
+    }
+  if (n == 0)
+    return;
+
+  sqe = get_sqe(u);
+  sqe->opcode = IORING_OP_WRITEV;
+  sqe->fd = s->out;
+  sqe->off = -1;
+  sqe->addr = (unsigned long)s->iov;
+  sqe->len = n;
+  sqe->user_data = index * 8 + OP_WRITE;
+  s->writing = n;
+}
+
+static void read_done (struct stream *s, struct io_uring_cqe *cqe,
+		       int multishot)
+{
+  struct chunk *c;
+
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    s->reading = 0;
+
+  s->counters->reads++;
+  if (cqe->res > 0)
+    {
+      unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      char *buffer = s->data + bid * CHUNK_SIZE;
+      unsigned length = cqe->res;
+
+      char *data = buffer + s->headroom;
+
+      if (s->chain != NULL)
+	{
+	  length = chain_process(s->chain, &data, length);
+	  if (length == 0)
+	    {
+	      give_buffer(s, bid);
+	      return;
+	    }
+	}
+
+      s->queued += length;
+      stats_buffered(s->counters, s->queued);
+      c = &s->queue[s->queue_tail++ & (s->count - 1)];
+      c->bid = bid;
+      c->offset = data - buffer;
+      c->length = length;
+      return;
+    }
+
+  switch (-cqe->res)
+    {
+    case 0:
+    case EIO:
+      // End of file, or the child is gone from the pty.
+      s->eof = 1;
+      break;
+    case ENOBUFS:
+      // Rearmed when writes give buffers back, unless one already did.
+      if (s->queue_tail - s->queue_head == s->count)
+	s->starved = 1;
+      break;
+    case EINTR:
+    case EAGAIN:
+    case ECANCELED:
+      break;
+    case EINVAL:
+    case EBADFD:
+    case EOPNOTSUPP:
+      // Not pollable, e.g. a regular file.  Read one at a time.
+      if (multishot)
+	{
+	  s->multishot = 0;
+	  break;
+	}
+      /* Fall through. */
+    default:
+      fatal("Error %d on read %s", -cqe->res, s->in_name);
+    }
+}
+
+// The input hung up, but there may still be data to read.  Stop the
+// multishot read, and once it's done read one at a time until the end.
+static void hup_done (struct uring *u, struct stream *s, int index)
+{
+  struct io_uring_sqe *sqe;
+
+  if (!s->multishot)
+    return;
+
+  s->multishot = 0;
+  if (s->reading)
+    {
+      sqe = get_sqe(u);
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->addr = index * 8 + OP_MULTISHOT;
+      sqe->user_data = index * 8 + OP_CANCEL;
+    }
+}
+
+static void write_done (struct stream *s, struct io_uring_cqe *cqe)
+{
+  unsigned written = 0;
+
+  s->writing = 0;
+  s->counters->writes++;
+
+  if (cqe->res < 0)
+    {
+      switch (-cqe->res)
+	{
+	case EINTR:
+	case EAGAIN:
+	  return;
+	case EIO:
+	  // The child has closed the pty, nobody wants the rest.
+	  written = ~0U;
+	  s->queued = 0;
+	  break;
+	default:
+	  fatal("Error %d on write %s", -cqe->res, s->out_name);
+	}
+    }
+  else
+    {
+      written = cqe->res;
+      s->counters->bytes += written;
+      s->queued -= written;
+      if (written < s->want)
+	s->counters->short_writes++;
+    }
+
+  while (s->queue_head != s->queue_tail)
+    {
+      struct chunk *c = &s->queue[s->queue_head & (s->count - 1)];
+      unsigned left = c->length - c->offset;
+
+      if (written < left)
+	{
+	  c->offset += written;
+	  break;
+	}
+      written -= left;
+      give_buffer(s, c->bid);
+      s->queue_head++;
+      s->starved = 0;
+    }
+}
+
+// Wait for a SIGWINCH to be reported on the pipe.
+static void arm_winch (struct uring *u)
+{
+  struct io_uring_sqe *sqe;
+
+  if (resize_fd() == -1)
+    return;
+
+  sqe = get_sqe(u);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = resize_fd();
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = OP_WINCH;
+}
+
+// Wait for the child to exit.
+static void arm_child (struct uring *u)
+{
+  struct io_uring_sqe *sqe;
+
+  if (child_fd() == -1)
+    return;
+
+  sqe = get_sqe(u);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = child_fd();
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = OP_CHILD;
+}
+
+// Wake up after usec, to see whether the output has gone quiet.
+static void arm_linger (struct uring *u, long long usec)
+{
+  static struct __kernel_timespec ts;
+  struct io_uring_sqe *sqe;
+
+  ts.tv_sec = usec / 1000000;
+  ts.tv_nsec = usec % 1000000 * 1000;
+
+  sqe = get_sqe(u);
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = (unsigned long)&ts;
+  sqe->len = 1;
+  sqe->user_data = OP_LINGER;
+}
+
+void uring_master (int fdm)
+{
+  struct uring u;
+  struct stream streams[2];
+  struct io_uring_cqe *cqe;
+  unsigned head;
+  int i, rc, lingering = 0;
+  long long exited = 0;  // When the program exited,
+  long long quiet = 0;   // and the last output since.
+  long long now;
+
+  if (uring_init(&u) < 0)
+    return;
+  // No triggers here, so nothing to respond with.
+  chain_output(&output_chain, fdm, NULL, NULL);
+
+  if (stream_init(&u, &streams[0], 0, "standard input", 0,
+		  "master pty", fdm) < 0
+      || stream_init(&u, &streams[1], 1, "master pty", fdm,
+		     "standard output", 1) < 0)
+    {
+      close(u.fd);
+      return;
+    }
+  stats.engine = "uring";
+  arm_winch(&u);
+  arm_child(&u);
+
+  for (;;)
+    {
+      stats_check();
+
+      for (i = 0; i < 2; i++)
+	{
+	  start_write(&u, &streams[i], i);
+	  arm_read(&u, &streams[i], i);
+	}
+
+      // The program has exited, but something else holds the pty open
+      // so there will be no EIO.  Once a read has been waiting for
+      // CHILD_LINGER_USEC with nothing, that's the end.  Buffers that
+      // run out only delay it.
+      if (exited && !streams[1].eof)
+	{
+	  now = monotonic_usec();
+	  if (quiet < exited)
+	    quiet = exited;
+	  if (streams[1].reading && !streams[1].starved
+	      && now >= quiet + CHILD_LINGER_USEC)
+	    streams[1].eof = 1;
+	  else if (!lingering)
+	    {
+	      arm_linger(&u, quiet + CHILD_LINGER_USEC > now
+			 ? quiet + CHILD_LINGER_USEC - now : CHILD_LINGER_USEC);
+	      lingering = 1;
+	    }
+	}
+
+      // The child is gone.  Exit when all its output is written.
+      if (streams[1].eof && !streams[1].writing
+	  && streams[1].queue_head == streams[1].queue_tail)
+	exit(child_status());
+
+      rc = submit_and_wait(&u);
+      stats.wakeups++;
+      if (rc < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  fatal("Error %d on io_uring_enter()", errno);
+	}
+
+      head = *u.cq_head;
+      while (head != __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE))
+	{
+	  cqe = &u.cqes[head & *u.cq_mask];
+	  i = cqe->user_data / 8;
+	  switch (cqe->user_data % 8)
+	    {
+	    case OP_READ:
+	    case OP_MULTISHOT:
+	      read_done(&streams[i], cqe, cqe->user_data % 8 == OP_MULTISHOT);
+	      if (i == 1 && exited)
+		quiet = monotonic_usec();
+	      break;
+	    case OP_WRITE:
+	      write_done(&streams[i], cqe);
+	      break;
+	    case OP_HUP:
+	      hup_done(&u, &streams[i], i);
+	      break;
+	    case OP_WINCH:
+	      resize_apply();
+	      arm_winch(&u);
+	      break;
+	    case OP_CHILD:
+	      if (child_reap())
+		exited = monotonic_usec();
+	      else
+		arm_child(&u);
+	      break;
+	    case OP_LINGER:
+	      lingering = 0;
+	      break;
+	    }
+	  head++;
+	}
+      __atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+#else
+void uring_master (int fdm)
+{
+}
+#endif